@@ -1,6 +1,10 @@
 #pragma once
 
 #include "pch.h"
+#include <bit>
+#include <cstdint>
+#include <immintrin.h>
+
 #include "types.hpp"
 #include "graphics/color.hpp"
 #include "math/point.hpp"
@@ -9,16 +13,29 @@
 
 namespace rnd
 {
+	// Memory order of the color and depth buffers.
+	enum class pixel_layout
+	{
+		linear,	// row-major
+		tiled,	// HIZ_BLOCK x HIZ_BLOCK micro-tiles, row-major inside and in tile order
+	};
+
 	class framebuffer
 	{
 	public:
-		framebuffer(u32 width, u32 height) 
-			: 
-			width{ width },
-			height{ height },
-			color_buffer{ std::make_unique<color[]>(width * height) },
-			depth_buffer{ std::make_unique<f32[]>(width * height)}
-		{}
+		// side of the square pixel blocks the hierarchical z buffer tracks
+		static constexpr u32 HIZ_BLOCK = 8;
+
+		// pending_clear bits: the block still holds stale pixels, its real content is the clear value
+		static constexpr u8 CLEAR_COLOR = 1;
+		static constexpr u8 CLEAR_DEPTH = 2;
+
+		framebuffer(u32 width, u32 height, pixel_layout layout = pixel_layout::linear)
+			:
+			layout{ layout }
+		{
+			reset(width, height);
+		}
 
 		void put_pixel(u32 x, u32 y, const color& c)
 		{
@@ -27,8 +44,11 @@ namespace rnd
 			ASSERT(x >= 0, "x >= 0. x = {}", x);
 			ASSERT(y >= 0, "y >= 0. y = {}", y);
 
+			if (get_pending_clear(x, y) & CLEAR_COLOR)
+				resolve_block(x / HIZ_BLOCK, y / HIZ_BLOCK, CLEAR_COLOR);
+
 			//if (x < width && x >= 0 && y >= 0 && y < height)
-			color_buffer[y * width + x] = c;	
+			color_buffer[pixel_index(x, y)] = c;	
 		}
 
 		color get_pixel(u32 x, u32 y)
@@ -38,13 +58,25 @@ namespace rnd
 			ASSERT(x >= 0, "x >= 0. x = {}", x);
 			ASSERT(y >= 0, "y >= 0. y = {}", y);
 
+			if (get_pending_clear(x, y) & CLEAR_COLOR)
+				return clear_color_value;
+
 			//if (x < width && x >= 0 && y >= 0 && y < height)
-			return color_buffer[y * width + x];
+			return color_buffer[pixel_index(x, y)];
 		}
 
 		void clear_color(const color& c)
 		{
-			std::fill(color_buffer.get(), color_buffer.get() + (width * height), c);
+			clear_color_value = c;
+
+			if (fast_clear)
+			{
+				mark_cleared(CLEAR_COLOR);
+				return;
+			}
+
+			std::fill(color_buffer.get(), color_buffer.get() + buffer_size(), c);
+			unmark_cleared(CLEAR_COLOR);
 		}
 
 		inline void reset(u32 width, u32 height)
@@ -52,8 +84,65 @@ namespace rnd
 			this->width = width;
 			this->height = height;
 
-			color_buffer = std::make_unique<color[]>(width * height);
-			depth_buffer = std::make_unique<f32[]>(width * height);
+			hiz_width = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+			hiz_height = (height + HIZ_BLOCK - 1) / HIZ_BLOCK;
+
+			color_buffer = std::make_unique<color[]>(buffer_size());
+			depth_buffer = std::make_unique<f32[]>(buffer_size());
+
+			hiz_buffer = std::make_unique<f32[]>(hiz_width * hiz_height);
+			pending_clear = std::make_unique<u8[]>(hiz_width * hiz_height);
+		}
+
+		/// <summary>
+		/// Switches the memory order of the color and depth buffers. Their content is lost,
+		/// like on reset.
+		/// </summary>
+		inline void set_layout(pixel_layout layout)
+		{
+			this->layout = layout;
+			reset(width, height);
+		}
+
+		inline pixel_layout get_layout() const { return layout; }
+
+		// Offset of pixel (x, y) in color_buffer and depth_buffer. In both layouts the pixels of
+		// a micro-tile row are contiguous, so spans of up to HIZ_BLOCK aligned pixels can be
+		// copied from pixel_index(x, y) on.
+		inline size_t pixel_index(u32 x, u32 y) const
+		{
+			if (layout == pixel_layout::linear)
+				return (size_t)y * width + x;
+
+			const size_t tile = (size_t)(y / HIZ_BLOCK) * hiz_width + x / HIZ_BLOCK;
+			return tile * (HIZ_BLOCK * HIZ_BLOCK) + (y % HIZ_BLOCK) * HIZ_BLOCK + x % HIZ_BLOCK;
+		}
+
+		// Number of pixels the color and depth buffers hold; tiled buffers are padded to whole micro-tiles.
+		inline size_t buffer_size() const
+		{
+			if (layout == pixel_layout::linear)
+				return (size_t)width * height;
+			return (size_t)hiz_width * hiz_height * HIZ_BLOCK * HIZ_BLOCK;
+		}
+
+		/// <summary>
+		/// Copies the color buffer to dst in row-major order, pitch pixels per row, for display
+		/// or export. Pending fast clears have to be resolved first.
+		/// </summary>
+		void copy_linear_color(color* dst, size_t pitch) const
+		{
+			for (u32 y = 0; y < height; ++y)
+			{
+				if (layout == pixel_layout::linear)
+				{
+					std::copy_n(color_buffer.get() + (size_t)y * width, width, dst + y * pitch);
+					continue;
+				}
+
+				for (u32 x = 0; x < width; x += HIZ_BLOCK)
+					std::copy_n(color_buffer.get() + pixel_index(x, y), std::min(HIZ_BLOCK, width - x), dst + y * pitch + x);
+			}
 		}
 
 		inline u32 get_width()	const { return width; }
@@ -80,7 +169,10 @@ namespace rnd
 			ASSERT(x >= 0, "x >= 0. x = {}", x);
 			ASSERT(y >= 0, "y >= 0. y = {}", y);
 
-			return depth_buffer[y * width + x];
+			if (get_pending_clear(x, y) & CLEAR_DEPTH)
+				return clear_depth_value;
+
+			return depth_buffer[pixel_index(x, y)];
 		}
 
 		inline void set_depth(rnd::u32 x, rnd::u32 y, rnd::f32 depth)
@@ -90,23 +182,199 @@ namespace rnd
 			ASSERT(x >= 0, "x >= 0. x = {}", x);
 			ASSERT(y >= 0, "y >= 0. y = {}", y);
 
-			depth_buffer[y * width + x] = depth;
+			if (get_pending_clear(x, y) & CLEAR_DEPTH)
+				resolve_block(x / HIZ_BLOCK, y / HIZ_BLOCK, CLEAR_DEPTH);
+
+			depth_buffer[pixel_index(x, y)] = depth;
 		}
 
 		void clear_depth()
 		{
+			std::fill(hiz_buffer.get(), hiz_buffer.get() + hiz_width * hiz_height, MAX_DEPTH);
+
+			if (fast_clear)
+			{
+				mark_cleared(CLEAR_DEPTH);
+				return;
+			}
+
 			auto ptr = depth_buffer.get();
-			auto size = width * height;
+			auto size = buffer_size();
 			std::fill(ptr, ptr + size, MAX_DEPTH);
 			// std::fill(depth_buffer.get(), depth_buffer.get() + (width * height), MAX_DEPTH);
+			unmark_cleared(CLEAR_DEPTH);
 		}
 
 		inline const f32* get_depth_buffer() const { return depth_buffer.get(); }
 
+		/// <summary>
+		/// In fast clear mode clear_color and clear_depth only flag every HIZ_BLOCK block as
+		/// cleared. Whoever touches a block first writes the clear value into it (the tile
+		/// rasterizer does it in its tile buffer), and resolve writes the blocks nobody touched.
+		/// Code writing color_buffer or depth_buffer directly has to honor pending_clear.
+		/// </summary>
+		void set_fast_clear(bool enabled)
+		{
+			if (!enabled)
+				resolve();
+			fast_clear = enabled;
+		}
+
+		inline bool get_fast_clear() const { return fast_clear; }
+
+		inline u8 get_pending_clear(u32 x, u32 y) const
+		{
+			return pending_clear[(y / HIZ_BLOCK) * hiz_width + x / HIZ_BLOCK];
+		}
+
+		/// <summary>
+		/// Writes the clear values into the blocks of [x0, x1) x [y0, y1) that still wait for them.
+		/// </summary>
+		void resolve(u32 x0, u32 y0, u32 x1, u32 y1)
+		{
+			for (u32 by = y0 / HIZ_BLOCK; by < (y1 + HIZ_BLOCK - 1) / HIZ_BLOCK; ++by)
+			{
+				for (u32 bx = x0 / HIZ_BLOCK; bx < (x1 + HIZ_BLOCK - 1) / HIZ_BLOCK; ++bx)
+				{
+					const u8 pending = pending_clear[by * hiz_width + bx];
+					if (pending)
+						resolve_block(bx, by, pending);
+				}
+			}
+		}
+
+		/// <summary>
+		/// Writes the clear values into every block still waiting for them, before the frame is
+		/// presented. Nothing reads these pixels back this frame, so they are written with
+		/// non-temporal stores that bypass the caches.
+		/// </summary>
+		void resolve()
+		{
+			const __m128i color_value = _mm_set1_epi32(std::bit_cast<int>(clear_color_value));
+			const __m128i depth_value = _mm_set1_epi32(std::bit_cast<int>(clear_depth_value));
+
+			for (u32 by = 0; by < hiz_height; ++by)
+			{
+				const u8* flags = pending_clear.get() + by * hiz_width;
+
+				if (std::none_of(flags, flags + hiz_width, [](u8 f) { return f != 0; }))
+					continue;
+
+				const u32 y0 = by * HIZ_BLOCK;
+				const u32 y1 = std::min(y0 + HIZ_BLOCK, height);
+
+				// micro-tile rows are contiguous in both layouts
+				auto resolve_row = [&](u32 bx, u32 y, u8 pending) {
+					const size_t first = pixel_index(bx * HIZ_BLOCK, y);
+					const u32 n = std::min(HIZ_BLOCK, width - bx * HIZ_BLOCK);
+
+					if (pending & CLEAR_COLOR)
+						stream_span(color_buffer.get() + first, n, color_value);
+					if (pending & CLEAR_DEPTH)
+						stream_span(depth_buffer.get() + first, n, depth_value);
+				};
+
+				// walk the pixels in memory order, so the streaming stores fill whole cache lines:
+				// block by block when tiled, row by row when linear
+				if (layout == pixel_layout::tiled)
+				{
+					for (u32 bx = 0; bx < hiz_width; ++bx)
+					{
+						if (flags[bx])
+						{
+							for (u32 y = y0; y < y1; ++y)
+								resolve_row(bx, y, flags[bx]);
+						}
+					}
+				}
+				else
+				{
+					for (u32 y = y0; y < y1; ++y)
+					{
+						for (u32 bx = 0; bx < hiz_width; ++bx)
+						{
+							if (flags[bx])
+								resolve_row(bx, y, flags[bx]);
+						}
+					}
+				}
+
+				std::fill(pending_clear.get() + by * hiz_width, pending_clear.get() + (by + 1) * hiz_width, u8(0));
+			}
+
+			_mm_sfence();
+		}
+
 	public:
 		u32 width, height;
 		std::unique_ptr<color[]> color_buffer;
 		std::unique_ptr<f32[]> depth_buffer;
+
+		// Hierarchical z: an upper bound of the depth values in each HIZ_BLOCK x HIZ_BLOCK block.
+		// It stays conservative as long as depth only decreases between clears.
+		u32 hiz_width, hiz_height;
+		std::unique_ptr<f32[]> hiz_buffer;
+
+		// Fast clear: per hierarchical z block, which buffers still have to receive the clear value.
+		std::unique_ptr<u8[]> pending_clear;
+		color clear_color_value = {};
+		f32 clear_depth_value = MAX_DEPTH;
+
+	private:
+		void mark_cleared(u8 bits)
+		{
+			for (u32 i = 0; i < hiz_width * hiz_height; ++i)
+				pending_clear[i] |= bits;
+		}
+
+		void unmark_cleared(u8 bits)
+		{
+			for (u32 i = 0; i < hiz_width * hiz_height; ++i)
+				pending_clear[i] &= ~bits;
+		}
+
+		static_assert(HIZ_BLOCK == 8, "stream_span writes a micro-tile row as two 16 byte stores");
+
+		// Non-temporal fill of n <= HIZ_BLOCK pixels of 4 bytes. A whole micro-tile row on a
+		// 16 byte boundary takes two vector stores; spans cut by the right edge, or misaligned
+		// rows of a linear buffer whose width isn't a multiple of 4, fall back to 4 byte stores.
+		static void stream_span(void* dst, u32 n, __m128i value)
+		{
+			if (n == HIZ_BLOCK && (reinterpret_cast<std::uintptr_t>(dst) & 15) == 0)
+			{
+				__m128i* v = static_cast<__m128i*>(dst);
+				_mm_stream_si128(v, value);
+				_mm_stream_si128(v + 1, value);
+				return;
+			}
+
+			int* p = static_cast<int*>(dst);
+			for (u32 i = 0; i < n; ++i)
+				_mm_stream_si32(p + i, _mm_cvtsi128_si32(value));
+		}
+
+		// Writes the clear values of the buffers in bits into one block, through the caches:
+		// the block is about to be drawn to.
+		void resolve_block(u32 bx, u32 by, u8 bits)
+		{
+			const u32 x0 = bx * HIZ_BLOCK, x1 = std::min(x0 + HIZ_BLOCK, width);
+			const u32 y0 = by * HIZ_BLOCK, y1 = std::min(y0 + HIZ_BLOCK, height);
+
+			for (u32 y = y0; y < y1; ++y)
+			{
+				const size_t first = pixel_index(x0, y);
+
+				if (bits & CLEAR_COLOR)
+					std::fill_n(color_buffer.get() + first, x1 - x0, clear_color_value);
+				if (bits & CLEAR_DEPTH)
+					std::fill_n(depth_buffer.get() + first, x1 - x0, clear_depth_value);
+			}
+
+			pending_clear[by * hiz_width + bx] &= ~bits;
+		}
+
+		bool fast_clear = false;
+		pixel_layout layout = pixel_layout::linear;
 	};
 
 }
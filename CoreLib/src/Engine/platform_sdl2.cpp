@@ -123,7 +123,21 @@ namespace platform
 
 	void display_framebuffer(const rnd::framebuffer& fb)
 	{
-		SDL_UpdateTexture(state.texture, NULL, fb.get_color_buffer(), fb.get_width() * sizeof(rnd::color));
+		if (fb.get_layout() == rnd::pixel_layout::linear)
+		{
+			SDL_UpdateTexture(state.texture, NULL, fb.get_color_buffer(), fb.get_width() * sizeof(rnd::color));
+		}
+		else
+		{
+			// tiled framebuffers are linearized straight into the texture
+			void* pixels;
+			int pitch;
+			if (SDL_LockTexture(state.texture, NULL, &pixels, &pitch) == 0)
+			{
+				fb.copy_linear_color(static_cast<rnd::color*>(pixels), pitch / sizeof(rnd::color));
+				SDL_UnlockTexture(state.texture);
+			}
+		}
 		SDL_RenderClear(state.renderer);
 		SDL_RenderCopy(state.renderer, state.texture, NULL, NULL);
 		SDL_RenderPresent(state.renderer);
@@ -23,7 +23,9 @@ namespace simd
 			return ((int32_t*)&vec)[idx];
 		}
 		inline void store(void* ptr) const { _mm256_storeu_si256(static_cast<__m256i*>(ptr), vec); }
+		inline void store_masked(void* ptr, const vInt& mask) const { _mm256_maskstore_epi32(static_cast<int*>(ptr), mask.vec, vec); }
 		static inline vInt load(const void* ptr) { return _mm256_loadu_si256(static_cast<const __m256i*>(ptr)); }
+		static inline vInt load_masked(const void* ptr, const vInt& mask) { return _mm256_maskload_epi32(static_cast<const int*>(ptr), mask.vec); }
 		static inline vInt ramp() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
 
 	public:
@@ -46,7 +48,9 @@ namespace simd
 			return ((float*)&vec)[idx];
 		}
 		inline void store(void* ptr) const { _mm256_storeu_ps(static_cast<float*>(ptr), vec); }
+		inline void store_masked(void* ptr, const vInt& mask) const { _mm256_maskstore_ps(static_cast<float*>(ptr), mask.vec, vec); }
 		static inline vFloat load(const void* ptr) { return _mm256_loadu_ps(static_cast<const float*>(ptr)); }
+		static inline vFloat load_masked(const void* ptr, const vInt& mask) { return _mm256_maskload_ps(static_cast<const float*>(ptr), mask.vec); }
 	public:
 		__m256 vec;
 	};
@@ -111,6 +115,11 @@ namespace simd
 	inline vFloat4 operator*(vFloat4 a, vFloat4 b) { return { a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w }; }
 	inline vFloat4 operator/(vFloat4 a, vFloat4 b) { return { a.x / b.x, a.y / b.y, a.z / b.z, a.w / b.w }; }
 
+	inline vFloat3 operator+(vFloat3 a, vFloat3 b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+	inline vFloat3 operator-(vFloat3 a, vFloat3 b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+	inline vFloat3 operator*(vFloat3 a, vFloat3 b) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+	inline vFloat3 operator-(vFloat3 a) { return { -a.x, -a.y, -a.z }; }
+
 
 	struct vInt2
 	{
@@ -173,6 +182,15 @@ namespace simd
 	inline vFloat min(vFloat x, vFloat y) { return _mm256_min_ps(x, y); }
 	inline vFloat max(vFloat x, vFloat y) { return _mm256_max_ps(x, y); }
 
+	// largest of the eight lanes
+	inline float hmax(vFloat x)
+	{
+		__m128 m = _mm_max_ps(_mm256_castps256_ps128(x.vec), _mm256_extractf128_ps(x.vec, 1));
+		m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+		m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+		return _mm_cvtss_f32(m);
+	}
+
 	inline vFloat4 perspective_divide(const vFloat4& v)
 	{
 		vFloat rw = 1.f / v.w;
@@ -193,6 +211,33 @@ namespace simd
 		return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
 	}
 
+	inline vFloat sqrt(const vFloat& v)
+	{
+		return _mm256_sqrt_ps(v);
+	}
+
+	inline vFloat length(const vFloat3& v)
+	{
+		return sqrt(dot(v, v));
+	}
+
+	inline vFloat3 reflect(const vFloat3& I, const vFloat3& N)
+	{
+		return I - N * (dot(N, I) * vFloat(2.f));
+	}
+
+	// x^n for a small integer exponent, by repeated squaring
+	inline vFloat pow(vFloat x, uint32_t n)
+	{
+		vFloat result(1.f);
+		for (; n; n >>= 1, x = x * x)
+		{
+			if (n & 1)
+				result = result * x;
+		}
+		return result;
+	}
+
 	// Normalize a vFloat3 vector (using AVX sqrt)
 	inline vFloat3 normalize(const vFloat3& v) {
 		vFloat d = dot(v, v);
@@ -268,4 +313,19 @@ namespace simd
 	inline vInt round2i(vFloat x) { return _mm256_cvtps_epi32(x.vec); }
 	inline vInt trunc2i(vFloat x) { return _mm256_cvttps_epi32(x.vec); }
 	inline vFloat conv2f(vInt x) { return _mm256_cvtepi32_ps(x.vec); }
+
+	// bit casts, no conversion
+	inline vInt as_int(vFloat x) { return _mm256_castps_si256(x.vec); }
+	inline vFloat as_float(vInt x) { return _mm256_castsi256_ps(x.vec); }
+
+	// lane masks (all bits set where the comparison holds), unlike the
+	// comparison operators above which collapse the result to a bitmask
+	inline vInt mask_gt(vInt a, vInt b) { return _mm256_cmpgt_epi32(a, b); }
+	inline vInt mask_lt(vInt a, vInt b) { return _mm256_cmpgt_epi32(b, a); }
+	inline vInt mask_eq(vInt a, vInt b) { return _mm256_cmpeq_epi32(a, b); }
+	inline vInt andnot(vInt a, vInt b) { return _mm256_andnot_si256(a, b); }	// ~a & b
+
+	// one bit per lane
+	inline int movemask(vFloat mask) { return _mm256_movemask_ps(mask.vec); }
+	inline int movemask(vInt mask) { return _mm256_movemask_ps(_mm256_castsi256_ps(mask.vec)); }
 }
\ No newline at end of file
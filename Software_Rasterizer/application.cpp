@@ -64,6 +64,8 @@ void application::run()
 		update(dt);
 		render();
 
+		// blocks still pending a fast clear get their clear value before they are shown
+		fb.resolve();
 		platform::display_framebuffer(fb);
 	}
 }
@@ -129,18 +129,18 @@ void cube_plain_scene::render()
 // SHADERS
 /////////////////////////
 
-VSOutput BasicShaderProgram::VertexShader::operator()(const VSInput& in) const
+BasicShaderProgram::VSOut BasicShaderProgram::VertexShader::operator()(const VSInput& in) const
 {
 	math::vec3 pos = in.Get<math::vec3>(0);
 	math::vec3 color = in.Get<math::vec3>(1);
 	math::vec2 tc = in.Get<math::vec2>(2);
 	
-	VSOutput out;
+	VSOut out;
 	math::mat4 model = math::mat4::identity();
 
 	out.Position = _projection * _view * model * math::vec4{ pos, 1.0f };
-	out.setVarying<math::vec3>(0, color);
-	out.setVarying<math::vec2>(1, tc);
+	out.varyings.color = color;
+	out.varyings.tc = tc;
 	
 	return out;
 }
@@ -156,10 +156,10 @@ BasicShaderProgram::FragmentShader::FragmentShader()
 	surf = gfx::surface::from_file("../assets/checker.jpg");
 }
 
-math::vec4 BasicShaderProgram::FragmentShader::operator()(const VSOutput& vsout) const
+math::vec4 BasicShaderProgram::FragmentShader::operator()(const VSOut& vsout) const
 {
-	math::vec3 color = vsout.getVarying<math::vec3>(0);
-	math::vec2 tc = vsout.getVarying<math::vec2>(1);
+	math::vec3 color = vsout.varyings.color;
+	math::vec2 tc = vsout.varyings.tc;
 	
 	math::vec4 col = surf.sample(tc.x, tc.y) * math::vec4(color, 1.f);
 	//math::vec4 col = surf.sample(tc.x, tc.y);
@@ -9,9 +9,16 @@
 
 struct BasicShaderProgram
 {
+	struct Varyings
+	{
+		math::vec3 color;
+		math::vec2 tc;
+	};
+	using VSOut = TypedVSOutput<Varyings>;
+
 	struct VertexShader
 	{
-		VSOutput operator()(const VSInput& in) const;
+		VSOut operator()(const VSInput& in) const;
 
 		void bindViewMatrix(const math::mat4& view);
 	public:
@@ -23,7 +30,7 @@ struct BasicShaderProgram
 	struct FragmentShader
 	{
 		FragmentShader();
-		math::vec4 operator()(const VSOutput& vsout) const;
+		math::vec4 operator()(const VSOut& vsout) const;
 
 	public:
 		gfx::surface surf;
@@ -2,6 +2,8 @@
 
 #include "input.hpp"
 
+#include <algorithm>
+
 mode_scene::mode_scene(rnd::framebuffer& fb)
 	:
 	_fb(fb),
@@ -12,6 +14,14 @@ mode_scene::mode_scene(rnd::framebuffer& fb)
 {
 	_generic_renderer.SetViewport({ 0, 0 }, { 800, 600 });
 	_generic_renderer.BindShaderProgram(&_shader_program);
+	_generic_renderer.EnableTileAutoTune();
+
+	// clears only flag the framebuffer's blocks, the tiles write the clear value as they load
+	_fb.set_fast_clear(true);
+
+	// 8x8 micro-tiles keep the pixels the tiles and the lighting pass load close together;
+	// the platform layer linearizes the color buffer when it presents
+	_fb.set_layout(rnd::pixel_layout::tiled);
 
 
 	_point_light.position = { 5.f, 0.f, 0.f };
@@ -37,6 +47,44 @@ mode_scene::mode_scene(rnd::framebuffer& fb)
 		mesh.iboid = _generic_renderer.CreateIndexBuffer(mesh.indices.data(), mesh.indices.size());
 		_generic_renderer.BindIndexBuffer(mesh.iboid);
 	}
+
+	// big meshes hide the most, so they are the occluders
+	static constexpr size_t num_occluders = 3;
+
+	for (const gfx::mesh& mesh : the_model.meshes)
+		_occluders.push_back(&mesh);
+
+	std::sort(_occluders.begin(), _occluders.end(), [](const gfx::mesh* a, const gfx::mesh* b) {
+		return a->sphere.radius > b->sphere.radius;
+	});
+	_occluders.resize(std::min(_occluders.size(), num_occluders));
+
+	// a grid of short range lights around the model for the deferred mode
+	static constexpr int lights_x = 16, lights_z = 16;
+	static constexpr rnd::f32 lights_extent = 12.f;
+
+	for (int z = 0; z < lights_z; ++z)
+	{
+		for (int x = 0; x < lights_x; ++x)
+		{
+			point_light l;
+			l.position = {
+				lights_extent * (2.f * x / (lights_x - 1) - 1.f),
+				lights_extent * 0.5f * (rnd::f32)((x + z) % 5 - 2),
+				lights_extent * (2.f * z / (lights_z - 1) - 1.f)
+			};
+			l.ambient = { 0.f, 0.f, 0.f };
+			l.diffuse = { 0.5f + 0.5f * std::sin(0.7f * x), 0.5f + 0.5f * std::sin(0.9f * z + 2.f), 0.5f + 0.5f * std::sin(0.5f * (x + z) + 4.f) };
+			l.diffuse_intensity = 1.f;
+
+			l.att_const = 1.f;
+			l.att_linear = 0.7f;
+			l.att_quad = 1.8f;
+
+			_lights.push_back(l);
+			_light_volumes.push_back({ l.position, light_range(l) });
+		}
+	}
 }
 
 static rnd::f32 total_time = 0.f;
@@ -54,7 +102,7 @@ void mode_scene::update(rnd::f32 dt)
 	//_shader_program.vs.total_time += dt;
 }
 
-enum class REND_TYPE : int { NON_MT, MT, COUNT };
+enum class REND_TYPE : int { NON_MT, MT, MT_VISIBILITY, DEFERRED, COUNT };
 
 static REND_TYPE rend_type = REND_TYPE::MT;
 
@@ -65,31 +113,88 @@ void mode_scene::render()
 	_shader_program.vs.bindViewMatrix(_camera.get_view_matrix());
 	_shader_program.fs.bind_point_light(_point_light);
 
-	for (gfx::mesh& mesh : the_model.meshes)
+	// skip meshes outside the view before any of their vertices are shaded
+	const model_shader_program::vertex_shader& vs = _shader_program.vs;
+	const math::mat4 model_view_proj = vs._projection * vs._view * vs.model_matrix();
+	_cull_stats = {};
+	the_model.cull(model_view_proj, _visible_meshes, _cull_stats);
+
+	if (rnd::input::is_key_pressed(rnd::input::key_code::KP_1))
 	{
-		_generic_renderer.BindVertexBuffer(mesh.vboid);
-		_generic_renderer.BindIndexBuffer(mesh.iboid);
+		rend_type = REND_TYPE::NON_MT;
+	}
 
-		if (rnd::input::is_key_pressed(rnd::input::key_code::KP_1))
-		{
-			rend_type = REND_TYPE::NON_MT;
-		}
+	else if (rnd::input::is_key_pressed(rnd::input::key_code::KP_2))
+	{
+		rend_type = REND_TYPE::MT;
+	}
 
-		else if (rnd::input::is_key_pressed(rnd::input::key_code::KP_2))
-		{
-			rend_type = REND_TYPE::MT;
-		}
+	else if (rnd::input::is_key_pressed(rnd::input::key_code::KP_3))
+	{
+		rend_type = REND_TYPE::MT_VISIBILITY;
+	}
+
+	else if (rnd::input::is_key_pressed(rnd::input::key_code::KP_4))
+	{
+		rend_type = REND_TYPE::DEFERRED;
+	}
+
+	// bound before any draw, immediate draws rasterize with whatever is bound when they are issued;
+	// the visibility buffer shades once per pixel instead of once per depth test pass
+	_generic_renderer.EnableVisibilityBuffer(rend_type == REND_TYPE::MT_VISIBILITY);
+	_generic_renderer.BindGBuffer(rend_type == REND_TYPE::DEFERRED ? &_gbuffer : nullptr);
+
+	_generic_renderer.BeginFrame();
+
+	// then skip the ones hidden behind the occluders before their vertices are shaded
+	auto is_occluder = [this](const gfx::mesh* mesh) {
+		return std::find(_occluders.begin(), _occluders.end(), mesh) != _occluders.end();
+	};
+
+	for (const gfx::mesh* mesh : _visible_meshes)
+	{
+		if (!is_occluder(mesh))
+			continue;
+
+		_generic_renderer.BindVertexBuffer(mesh->vboid);
+		_generic_renderer.BindIndexBuffer(mesh->iboid);
+		_generic_renderer.DrawOccluder(mesh->indices.size());
+	}
+
+	for (const gfx::mesh* mesh : _visible_meshes)
+	{
+		_generic_renderer.BindVertexBuffer(mesh->vboid);
+		_generic_renderer.BindIndexBuffer(mesh->iboid);
+
+		if (!is_occluder(mesh))
+			_generic_renderer.SetDrawBounds(mesh->bounds, model_view_proj);
 
 		switch (rend_type)	
 		{
 		case REND_TYPE::MT:
-			_generic_renderer.DrawIndexedBin(mesh.indices.size());
+		case REND_TYPE::MT_VISIBILITY:
+		case REND_TYPE::DEFERRED:
+			_generic_renderer.DrawIndexedBin(mesh->indices.size());
 			break;
 		case REND_TYPE::NON_MT:
-			_generic_renderer.DrawIndexed(mesh.indices.size());
+			_generic_renderer.DrawIndexed(mesh->indices.size());
 			break;
 		}
 	}
+
+	_generic_renderer.EndFrame();
+
+	if (rend_type == REND_TYPE::DEFERRED)
+	{
+		// every tile only loops over the lights that reach it
+		_generic_renderer.ShadeDeferred(_light_volumes, [this](const GBufferSample& sample, std::span<const rnd::u32> visible) {
+			math::vec3 result = 0.05f * sample.albedo;
+			for (rnd::u32 i : visible)
+				result = result + _shader_program.fs.shade_light(sample, _lights[i]);
+
+			return math::vec4(result, 1.f);
+		});
+	}
 }
 
 ////////// SHADERS //////////
@@ -101,7 +206,7 @@ VSOutput model_shader_program::vertex_shader::operator()(const VSInput& in) cons
 	math::vec2 tc = in.Get<math::vec2>(2);
 
 	VSOutput out;
-	math::mat4 model = math::mat4::translate({ 0.f, 0.f, total_time }) * math::mat4::scale(1.5f);
+	math::mat4 model = model_matrix();
 	out.Position = _projection * _view * model * math::vec4{ pos, 1.0f };
 	normal = model * normal;
 
@@ -112,11 +217,71 @@ VSOutput model_shader_program::vertex_shader::operator()(const VSInput& in) cons
 	return out;
 }
 
+VSOutputBatch model_shader_program::vertex_shader::operator()(const VSInputBatch& in) const
+{
+	simd::vFloat3 pos = in.Get<simd::vFloat3>(0);
+	simd::vFloat3 normal = in.Get<simd::vFloat3>(1);
+	simd::vFloat2 tc = in.Get<simd::vFloat2>(2);
+
+	VSOutputBatch out;
+	math::mat4 model = model_matrix();
+	out.Position = (_projection * _view * model) * simd::vFloat4{ pos, 1.0f };
+	simd::vFloat4 n = model * simd::vFloat4{ normal, 0.0f };
+	normal = { n.x, n.y, n.z };
+
+	out.setVarying(0, pos);
+	out.setVarying(1, normal);
+	out.setVarying(2, tc);
+
+	return out;
+}
+
+math::vec4 model_shader_program::vertex_shader::position(const VSInput& in) const
+{
+	math::vec3 pos = in.Get<math::vec3>(0);
+
+	return _projection * _view * model_matrix() * math::vec4{ pos, 1.0f };
+}
+
 void model_shader_program::vertex_shader::bindViewMatrix(const math::mat4& view)
 {
 	_view = view;
 }
 
+math::mat4 model_shader_program::vertex_shader::model_matrix() const
+{
+	return math::mat4::translate({ 0.f, 0.f, total_time }) * math::mat4::scale(1.5f);
+}
+
+GBufferSample model_shader_program::fragment_shader::surface(const VSOutput& vsout) const
+{
+	return {
+		vsout.getVarying<math::vec3>(0),
+		math::normalize(vsout.getVarying<math::vec3>(1)),
+		math::vec3(1.f)
+	};
+}
+
+math::vec3 model_shader_program::fragment_shader::shade_light(const GBufferSample& sample, const point_light& light) const
+{
+	// diffuse
+	math::vec3 lightDir = math::normalize(light.position - sample.position);
+	rnd::f32 diff = std::max(math::dot(sample.normal, lightDir), 0.0f);
+	math::vec3 diffuse = diff * light.diffuse;
+
+	// specular
+	rnd::f32 specularStrength = 0.5;
+	math::vec3 viewDir = math::normalize(cam_pos - sample.position);
+	math::vec3 reflectDir = reflect(-lightDir, sample.normal);
+	rnd::f32 spec = pow(std::max(math::dot(viewDir, reflectDir), 0.0f), 5.f);
+	math::vec3 specular = specularStrength * spec * light.diffuse;
+
+	rnd::f32 distance = math::length(light.position - sample.position);
+	rnd::f32 attenuation = 1.f / (light.att_const + light.att_linear * distance + light.att_quad * distance * distance);
+
+	return (diffuse + specular) * sample.albedo * attenuation;
+}
+
 model_shader_program::fragment_shader::fragment_shader()
 {
 	surf = gfx::surface::from_file("../assets/checker.jpg");
@@ -168,3 +333,38 @@ math::vec4 model_shader_program::fragment_shader::operator()(const VSOutput& vso
 	return color;
 }
 
+simd::vFloat4 model_shader_program::fragment_shader::operator()(const VSOutputBatch& vsout, [[maybe_unused]] const simd::vInt& mask) const
+{
+	using namespace simd;
+
+	const vFloat3 light_pos(p_light.position.x, p_light.position.y, p_light.position.z);
+	const vFloat3 light_diffuse(p_light.diffuse.x, p_light.diffuse.y, p_light.diffuse.z);
+
+	vFloat3 frag_pos = vsout.getVarying<vFloat3>(0);
+	vFloat3 normal = vsout.getVarying<vFloat3>(1);
+
+	vFloat3 object_color(1.f);
+
+	vFloat ambientStrength = 0.1f;
+	vFloat3 ambient = vFloat3(ambientStrength) * light_diffuse;
+
+	// diffuse
+	vFloat3 norm = normalize(normal);
+	vFloat3 lightDir = normalize(light_pos - frag_pos);
+	vFloat diff = max(dot(norm, lightDir), 0.0f);
+	vFloat3 diffuse = vFloat3(diff) * light_diffuse;
+
+	// specular
+	vFloat specularStrength = 0.5f;
+	vFloat3 viewDir = normalize(vFloat3(cam_pos.x, cam_pos.y, cam_pos.z) - frag_pos);
+	vFloat3 reflectDir = reflect(-lightDir, norm);
+	vFloat spec = pow(max(dot(viewDir, reflectDir), 0.0f), 5);
+	vFloat3 specular = vFloat3(specularStrength * spec) * light_diffuse;
+
+	vFloat distance = length(light_pos - frag_pos);
+	vFloat attenuation = vFloat(1.f) / (vFloat(p_light.att_const) + vFloat(p_light.att_linear) * distance + vFloat(p_light.att_quad) * distance * distance);
+
+	vFloat3 result = (ambient + diffuse + specular) * object_color * vFloat3(attenuation);
+
+	return vFloat4(result, 1.f);
+}
@@ -14,8 +14,13 @@ struct model_shader_program
 	struct vertex_shader
 	{
 		VSOutput operator()(const VSInput& in) const;
+		VSOutputBatch operator()(const VSInputBatch& in) const;
+
+		// clip space position only, for occluders
+		math::vec4 position(const VSInput& in) const;
 
 		void bindViewMatrix(const math::mat4& view);
+		math::mat4 model_matrix() const;
 	public:
 		math::mat4 _view = math::mat4::identity();
 		math::mat4 _projection = math::mat4::perspective(0.1f, 100.f, math::pi32 / 2.f, 800.f / 600.f);
@@ -29,6 +34,11 @@ struct model_shader_program
 		void bind_view_direction(const math::vec3& view_dir);
 
 		math::vec4 operator()(const VSOutput& vsout) const;
+		simd::vFloat4 operator()(const VSOutputBatch& vsout, const simd::vInt& mask) const;
+
+		// deferred shading: the G-buffer sample of a pixel, and the light one light adds to it
+		GBufferSample surface(const VSOutput& vsout) const;
+		math::vec3 shade_light(const GBufferSample& sample, const point_light& light) const;
 
 	public:
 		gfx::surface surf;
@@ -47,6 +57,12 @@ struct mode_scene : iscene
 	void update(rnd::f32 dt) override;
 	void render() override;
 
+	// meshes and triangles skipped by frustum culling in the last render()
+	const gfx::cull_stats& get_cull_stats() const { return _cull_stats; }
+
+	// draws skipped because the occluders hid them in the last render()
+	const OcclusionStats& get_occlusion_stats() const { return _generic_renderer.GetOcclusionStats(); }
+
 private:
 	rnd::framebuffer& _fb;
 	model_shader_program _shader_program;
@@ -59,5 +75,13 @@ private:
 	rnd::orbit_camera_controller _cam_ctrl;
 
 	gfx::model the_model;
+	std::vector<const gfx::mesh*> _visible_meshes;
+	gfx::cull_stats _cull_stats;
+	std::vector<const gfx::mesh*> _occluders;	// the largest meshes, drawn into the occlusion buffer first
 	point_light _point_light;
+
+	// deferred mode, lit by many small lights instead of _point_light
+	GBuffer _gbuffer;
+	std::vector<point_light> _lights;
+	std::vector<LightVolume> _light_volumes;
 };
\ No newline at end of file
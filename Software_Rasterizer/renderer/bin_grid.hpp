@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "types.hpp"
+#include "math/vector.hpp"
+
+/// <summary>
+/// Screen space tile grid used for binning, sized at runtime from the framebuffer.
+/// Tile dimensions are rounded up to multiples of the 8x8 raster block.
+/// </summary>
+struct BinGrid
+{
+	static constexpr rnd::i32 DEFAULT_TILE_W = 128;
+	static constexpr rnd::i32 DEFAULT_TILE_H = 64;
+
+	// Tiles must be made of whole raster blocks: the raster workers own the hierarchical z
+	// and fast clear entries of their blocks, and tile buffers copy whole block rows.
+	static constexpr rnd::i32 TILE_ALIGN = 8;
+
+	static inline rnd::i32 AlignTileSize(rnd::i32 size)
+	{
+		return std::max(TILE_ALIGN, (size + TILE_ALIGN - 1) & ~(TILE_ALIGN - 1));
+	}
+
+	rnd::i32 width = 0, height = 0;
+	rnd::i32 tileW = DEFAULT_TILE_W, tileH = DEFAULT_TILE_H;
+	rnd::i32 numTX = 0, numTY = 0;
+
+	/// <summary>
+	/// Recomputes the tile counts. Returns true if the layout changed.
+	/// </summary>
+	bool Resize(rnd::i32 width, rnd::i32 height, rnd::i32 tileW, rnd::i32 tileH)
+	{
+		tileW = AlignTileSize(tileW);
+		tileH = AlignTileSize(tileH);
+
+		if (width == this->width && height == this->height && tileW == this->tileW && tileH == this->tileH && numTX != 0)
+			return false;
+
+		this->width = width;
+		this->height = height;
+		this->tileW = tileW;
+		this->tileH = tileH;
+
+		numTX = (width + tileW - 1) / tileW;
+		numTY = (height + tileH - 1) / tileH;
+		return true;
+	}
+
+	inline rnd::i32 NumTiles() const { return numTX * numTY; }
+
+	inline void TileBounds(rnd::i32 idx, rnd::i32& x0, rnd::i32& y0, rnd::i32& x1, rnd::i32& y1) const
+	{
+		const rnd::i32 ty = idx / numTX;
+		const rnd::i32 tx = idx % numTX;
+
+		x0 = tx * tileW;
+		y0 = ty * tileH;
+		x1 = std::min(x0 + tileW, width);
+		y1 = std::min(y0 + tileH, height);
+	}
+};
+
+/// <summary>
+/// Fixed-size block of triangle indices. A bin is a linked list of these.
+/// </summary>
+struct BinChunk
+{
+	static constexpr rnd::i32 CAPACITY = 62;
+
+	rnd::i32 tris[CAPACITY];
+	rnd::i32 count = 0;
+	BinChunk* next = nullptr;
+};
+
+/// <summary>
+/// The bins written by a single binning thread, one list per tile.
+/// Only the owning thread appends, so no atomics are needed, and because each thread
+/// bins a contiguous range of triangles, walking the threads in order visits a tile's
+/// triangles in submission order. Chunks are pooled and reused between draws.
+/// </summary>
+struct alignas(64) ThreadBins
+{
+	struct List
+	{
+		BinChunk* head = nullptr;
+		BinChunk* tail = nullptr;
+		rnd::i32 count = 0;
+	};
+
+	std::vector<List> lists;	// [numTiles]
+
+	void Reset(rnd::i32 numTiles)
+	{
+		lists.assign(numTiles, List{});
+		usedChunks = 0;
+	}
+
+	inline bool Empty(rnd::i32 tile) const { return lists[tile].head == nullptr; }
+	inline rnd::i32 Count(rnd::i32 tile) const { return lists[tile].count; }
+
+	inline void Push(rnd::i32 tile, rnd::i32 tri)
+	{
+		List& l = lists[tile];
+		if (!l.tail || l.tail->count == BinChunk::CAPACITY)
+		{
+			BinChunk* c = allocChunk();
+			if (l.tail)
+				l.tail->next = c;
+			else
+				l.head = c;
+			l.tail = c;
+		}
+		l.tail->tris[l.tail->count++] = tri;
+		++l.count;
+	}
+
+	template <typename Func>
+	inline void ForEach(rnd::i32 tile, Func&& f) const
+	{
+		for (const BinChunk* c = lists[tile].head; c; c = c->next)
+			for (rnd::i32 i = 0; i < c->count; ++i)
+				f(c->tris[i]);
+	}
+
+private:
+	BinChunk* allocChunk()
+	{
+		if (usedChunks == chunks.size())
+			chunks.push_back(std::make_unique<BinChunk>());
+
+		BinChunk* c = chunks[usedChunks++].get();
+		c->count = 0;
+		c->next = nullptr;
+		return c;
+	}
+
+	std::vector<std::unique_ptr<BinChunk>> chunks;
+	size_t usedChunks = 0;
+};
+
+/// <summary>
+/// Picks the fastest tile shape for this machine by timing whole frames.
+/// Every candidate is used for FRAMES_PER_CANDIDATE frames (the first one is
+/// discarded as warm-up) and the best frame time of each is compared.
+/// </summary>
+struct TileAutoTuner
+{
+	static constexpr rnd::i32 FRAMES_PER_CANDIDATE = 6;
+
+	std::vector<math::vec2i> candidates = {
+		{ 32, 32 }, { 64, 32 }, { 64, 64 }, { 128, 32 }, { 128, 64 }, { 128, 128 }, { 256, 64 }, { 256, 128 }
+	};
+
+	void Start()
+	{
+		active = true;
+		current = 0;
+		frame = 0;
+		frame_ms = 0.0;
+		best_ms.assign(candidates.size(), std::numeric_limits<rnd::f64>::max());
+	}
+
+	inline bool IsActive() const { return active; }
+	inline math::vec2i CurrentCandidate() const { return candidates[current]; }
+
+	void AddTime(rnd::f64 ms) { frame_ms += ms; }
+
+	/// <summary>
+	/// Records the frame that just ended and returns the tile size to use for the next one.
+	/// Once every candidate has been measured the tuner deactivates itself.
+	/// </summary>
+	math::vec2i EndFrame()
+	{
+		// frames without binned draws tell us nothing
+		if (frame_ms == 0.0)
+			return candidates[current];
+
+		if (frame > 0)
+			best_ms[current] = std::min(best_ms[current], frame_ms);
+
+		frame_ms = 0.0;
+
+		if (++frame < FRAMES_PER_CANDIDATE)
+			return candidates[current];
+
+		frame = 0;
+		if (++current < candidates.size())
+			return candidates[current];
+
+		active = false;
+		current = std::min_element(best_ms.begin(), best_ms.end()) - best_ms.begin();
+		return candidates[current];
+	}
+
+private:
+	bool active = false;
+	size_t current = 0;
+	rnd::i32 frame = 0;
+	rnd::f64 frame_ms = 0.0;
+	std::vector<rnd::f64> best_ms;
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "math/vector.hpp"
+#include "math/matrix.hpp"
+#include "types.hpp"
+
+namespace gfx
+{
+	// Object space axis aligned bounding box.
+	struct aabb
+	{
+		math::vec3 min = math::vec3(std::numeric_limits<rnd::f32>::max());
+		math::vec3 max = math::vec3(-std::numeric_limits<rnd::f32>::max());
+
+		void expand(const math::vec3& p)
+		{
+			min = { std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z) };
+			max = { std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z) };
+		}
+
+		bool empty() const { return min.x > max.x; }
+
+		math::vec3 center() const { return (min + max) * 0.5f; }
+		math::vec3 extents() const { return (max - min) * 0.5f; }
+	};
+
+	// Object space bounding sphere, centered on the box so it is cheap to build.
+	struct bounding_sphere
+	{
+		math::vec3 center;
+		rnd::f32 radius = 0.f;
+	};
+
+	/// <summary>
+	/// The six clip planes of a view projection (or model view projection) matrix, in the
+	/// space the matrix transforms from. Planes are normalized and point inwards.
+	/// </summary>
+	struct frustum
+	{
+		enum plane_id { PLANE_LEFT, PLANE_RIGHT, PLANE_BOTTOM, PLANE_TOP, PLANE_NEAR, PLANE_FAR, PLANE_COUNT };
+
+		math::vec4 planes[PLANE_COUNT];
+
+		// Gribb/Hartmann plane extraction for OpenGL style clip space (-w <= z <= w).
+		static frustum from_matrix(const math::mat4& m)
+		{
+			auto row = [&](int r) {
+				return math::vec4{ m.values[r], m.values[4 + r], m.values[8 + r], m.values[12 + r] };
+			};
+
+			const math::vec4 r0 = row(0), r1 = row(1), r2 = row(2), r3 = row(3);
+
+			frustum f;
+			f.planes[PLANE_LEFT] = r3 + r0;
+			f.planes[PLANE_RIGHT] = r3 - r0;
+			f.planes[PLANE_BOTTOM] = r3 + r1;
+			f.planes[PLANE_TOP] = r3 - r1;
+			f.planes[PLANE_NEAR] = r3 + r2;
+			f.planes[PLANE_FAR] = r3 - r2;
+
+			for (math::vec4& p : f.planes)
+			{
+				const rnd::f32 len = std::sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+				p = p * (1.f / len);
+			}
+
+			return f;
+		}
+
+		bool intersects(const bounding_sphere& s) const
+		{
+			for (const math::vec4& p : planes)
+			{
+				if (p.x * s.center.x + p.y * s.center.y + p.z * s.center.z + p.w < -s.radius)
+					return false;
+			}
+			return true;
+		}
+
+		// Tests the box corner furthest along each plane normal.
+		bool intersects(const aabb& b) const
+		{
+			for (const math::vec4& p : planes)
+			{
+				const rnd::f32 x = p.x >= 0.f ? b.max.x : b.min.x;
+				const rnd::f32 y = p.y >= 0.f ? b.max.y : b.min.y;
+				const rnd::f32 z = p.z >= 0.f ? b.max.z : b.min.z;
+
+				if (p.x * x + p.y * y + p.z * z + p.w < 0.f)
+					return false;
+			}
+			return true;
+		}
+	};
+
+	// What a culling pass skipped, reset by the caller every frame.
+	struct cull_stats
+	{
+		rnd::u32 meshes_tested = 0;
+		rnd::u32 meshes_culled = 0;
+		rnd::u64 triangles_culled = 0;
+	};
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "types.hpp"
+#include "math/vector.hpp"
+#include "viewport.hpp"
+#include "varying.hpp"
+#include "triangle_setup.hpp"
+
+// Clip-space outcode bits. The frustum bits are only used to trivially reject triangles
+// that are entirely outside one plane. Triangles are actually clipped only against the
+// near plane and the guard band; everything else is scissored by the tile rasterizer.
+static constexpr rnd::u16 CLIP_LEFT = 1 << 0;
+static constexpr rnd::u16 CLIP_RIGHT = 1 << 1;
+static constexpr rnd::u16 CLIP_BOTTOM = 1 << 2;
+static constexpr rnd::u16 CLIP_TOP = 1 << 3;
+static constexpr rnd::u16 CLIP_NEAR = 1 << 4;
+static constexpr rnd::u16 CLIP_FAR = 1 << 5;
+static constexpr rnd::u16 CLIP_GB_LEFT = 1 << 6;
+static constexpr rnd::u16 CLIP_GB_RIGHT = 1 << 7;
+static constexpr rnd::u16 CLIP_GB_BOTTOM = 1 << 8;
+static constexpr rnd::u16 CLIP_GB_TOP = 1 << 9;
+
+static constexpr rnd::u16 CLIP_REJECT_MASK = CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR;
+static constexpr rnd::u16 CLIP_PLANES_MASK = CLIP_NEAR | CLIP_GB_LEFT | CLIP_GB_RIGHT | CLIP_GB_BOTTOM | CLIP_GB_TOP;
+
+/// <summary>
+/// Guard band extent in NDC units (1 is the viewport edge). Sized per viewport so that
+/// every vertex inside it still snaps inside FIXED_POINT_LIMIT.
+/// </summary>
+struct GuardBand
+{
+	rnd::f32 x = 1.f, y = 1.f;
+
+	static GuardBand For(const viewport& vp)
+	{
+		auto extent = [](rnd::i32 lo, rnd::i32 hi) {
+			const rnd::f32 half = 0.5f * (rnd::f32)(hi - lo);
+			const rnd::f32 center = (rnd::f32)lo + half;
+
+			// keep a pixel of slack for the snapping
+			if (half <= 0.f)
+				return 1.f;
+			return std::max(1.f, (FIXED_POINT_LIMIT - 1.f - std::abs(center)) / half);
+		};
+
+		return { extent(vp.xmin, vp.xmax), extent(vp.ymin, vp.ymax) };
+	}
+};
+
+static inline rnd::u16 ComputeOutcode(const math::vec4& p, const GuardBand& gb)
+{
+	rnd::u16 code = 0;
+
+	if (p.x < -p.w) code |= CLIP_LEFT;
+	if (p.x > p.w) code |= CLIP_RIGHT;
+	if (p.y < -p.w) code |= CLIP_BOTTOM;
+	if (p.y > p.w) code |= CLIP_TOP;
+	if (p.z < -p.w) code |= CLIP_NEAR;	// also catches w <= 0
+	if (p.z > p.w) code |= CLIP_FAR;
+
+	if (p.x < -gb.x * p.w) code |= CLIP_GB_LEFT;
+	if (p.x > gb.x * p.w) code |= CLIP_GB_RIGHT;
+	if (p.y < -gb.y * p.w) code |= CLIP_GB_BOTTOM;
+	if (p.y > gb.y * p.w) code |= CLIP_GB_TOP;
+
+	return code;
+}
+
+/// <summary>
+/// Post-transform data of a shaded vertex: its clip-space outcode and its screen space
+/// position (x, y in pixels, NDC z, 1/w). The position is meaningless when CLIP_NEAR is set.
+/// </summary>
+struct ScreenVertex
+{
+	math::vec4 position;
+	rnd::u16 outcode = 0;
+};
+
+// Each clip plane adds at most one vertex to the convex polygon.
+static constexpr size_t MAX_CLIP_VERTICES = 3 + 5;
+
+template <typename Vertex>
+struct ClipPolygon
+{
+	struct Point
+	{
+		math::vec4 position;
+		rnd::f32 varyings[MaxVaryingFloats<Vertex>];
+	};
+
+	Point points[MAX_CLIP_VERTICES];
+	size_t count = 0;
+};
+
+/// <summary>
+/// Clips a polygon (initially the triangle) against the near plane and the guard band planes
+/// flagged in clipCodes, in clip space. numFloats varyings are interpolated along with the
+/// position. Returns the number of vertices left; fewer than 3 means nothing is visible.
+/// </summary>
+template <typename Vertex>
+static inline size_t ClipPolygonPlanes(ClipPolygon<Vertex>& poly, rnd::u16 clipCodes, const GuardBand& gb, size_t numFloats)
+{
+	using Point = typename ClipPolygon<Vertex>::Point;
+
+	const std::pair<rnd::u16, math::vec4> planes[] = {
+		{ CLIP_NEAR,		{ 0.f, 0.f, 1.f, 1.f } },	//  Z > -W
+		{ CLIP_GB_LEFT,		{ 1.f, 0.f, 0.f, gb.x } },	//  X > -gb * W
+		{ CLIP_GB_RIGHT,	{ -1.f, 0.f, 0.f, gb.x } },	//  X <  gb * W
+		{ CLIP_GB_BOTTOM,	{ 0.f, 1.f, 0.f, gb.y } },	//  Y > -gb * W
+		{ CLIP_GB_TOP,		{ 0.f, -1.f, 0.f, gb.y } },	//  Y <  gb * W
+	};
+
+	// t is measured from the inside point, so a shared edge gives the same vertex in both triangles
+	auto intersect = [numFloats](const Point& in, const Point& out, rnd::f32 din, rnd::f32 dout) {
+		const rnd::f32 t = din / (din - dout);
+
+		Point p;
+		p.position = in.position + (out.position - in.position) * t;
+		for (size_t k = 0; k < numFloats; ++k)
+			p.varyings[k] = in.varyings[k] + (out.varyings[k] - in.varyings[k]) * t;
+		return p;
+	};
+
+	ClipPolygon<Vertex> scratch;
+	ClipPolygon<Vertex>* src = &poly;
+	ClipPolygon<Vertex>* dst = &scratch;
+
+	for (const auto& [code, equation] : planes)
+	{
+		if (!(clipCodes & code))
+			continue;
+
+		dst->count = 0;
+
+		for (size_t i = 0; i < src->count; ++i)
+		{
+			const Point& a = src->points[i];
+			const Point& b = src->points[(i + 1) % src->count];
+
+			const rnd::f32 da = math::dot(a.position, equation);
+			const rnd::f32 db = math::dot(b.position, equation);
+
+			if (da >= 0.f)
+				dst->points[dst->count++] = a;
+
+			if (da >= 0.f && db < 0.f)
+				dst->points[dst->count++] = intersect(a, b, da, db);
+			else if (da < 0.f && db >= 0.f)
+				dst->points[dst->count++] = intersect(b, a, db, da);
+		}
+
+		std::swap(src, dst);
+
+		if (src->count < 3)
+		{
+			poly.count = 0;
+			return 0;
+		}
+	}
+
+	if (src != &poly)
+		poly = *src;
+
+	return poly.count;
+}
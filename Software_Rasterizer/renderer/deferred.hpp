@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <limits>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "types.hpp"
+#include "math/vector.hpp"
+#include "frame_buffer.hpp"
+#include "varying.hpp"
+#include "tile_rasterizer.hpp"
+
+/// <summary>
+/// What the fragment shader's surface() produces for a pixel in deferred mode.
+/// Everything the lighting pass needs: where the surface is, where it faces and its color.
+/// </summary>
+struct GBufferSample
+{
+	math::vec3 position;
+	math::vec3 normal;
+	math::vec3 albedo;
+};
+
+template <typename ShaderProgram>
+concept DeferredFragmentShader = requires(const ShaderProgram& p, const ShaderVertex<ShaderProgram>& v)
+{
+	{ p.fs.surface(v) } -> std::convertible_to<GBufferSample>;
+};
+
+/// <summary>
+/// G-buffer render targets, one array per attribute. Pixels the depth buffer marks as
+/// empty (MAX_DEPTH) hold stale data and are skipped by the lighting pass, so the
+/// targets never need clearing. That only holds while every draw that writes depth
+/// also writes the G-buffer.
+/// </summary>
+struct GBuffer
+{
+	void Resize(rnd::u32 width, rnd::u32 height)
+	{
+		if (width == _width && height == _height)
+			return;
+
+		_width = width;
+		_height = height;
+
+		const size_t size = (size_t)width * height;
+		position = std::make_unique<math::vec3[]>(size);
+		normal = std::make_unique<math::vec3[]>(size);
+		albedo = std::make_unique<math::vec3[]>(size);
+	}
+
+	inline void Write(size_t index, const GBufferSample& s)
+	{
+		position[index] = s.position;
+		normal[index] = s.normal;
+		albedo[index] = s.albedo;
+	}
+
+	inline GBufferSample Read(size_t index) const
+	{
+		return { position[index], normal[index], albedo[index] };
+	}
+
+	inline rnd::u32 GetWidth() const { return _width; }
+	inline rnd::u32 GetHeight() const { return _height; }
+
+	std::unique_ptr<math::vec3[]> position;
+	std::unique_ptr<math::vec3[]> normal;
+	std::unique_ptr<math::vec3[]> albedo;
+
+private:
+	rnd::u32 _width = 0, _height = 0;
+};
+
+// Geometry pass of deferred shading: like TileResolveFunctor, but every pixel with a
+// triangle id gets its surface written to the G-buffer instead of a shaded color.
+template <typename ShaderProgram>
+struct TileGBufferFunctor
+{
+	using Vertex = ShaderVertex<ShaderProgram>;
+
+	template <typename Resolve>
+	void operator()(int tileStartX, int tileStartY, int tileEndX, int tileEndY, const TileBuffer& tile, GBuffer& gbuffer, rnd::u32 fb_width, Resolve&& resolve)
+	{
+		for (int y = tileStartY; y < tileEndY; ++y)
+		{
+			for (int x = tileStartX; x < tileEndX; ++x)
+			{
+				const rnd::u32 id = tile.visibility[tile.Index(x, y)];
+				if (id == 0)
+					continue;
+
+				const size_t index = (size_t)y * fb_width + x;
+
+				const VisibleTriangle<ShaderProgram> v = resolve(id);
+				const Triangle<Vertex>& t = *v.triangle;
+
+				const rnd::f32 fx = (rnd::f32)(x - t.setup.xmin);
+				const rnd::f32 fy = (rnd::f32)(y - t.setup.ymin);
+				const rnd::f32 z = 1.f / t.position[3].At(fx, fy);
+
+				gbuffer.Write(index, v.program->fs.surface(InterpolatePlanes(t, v.planes, fx, fy, z)));
+			}
+		}
+	}
+};
+
+/// <summary>
+/// Sphere a light can reach, in the space of the G-buffer positions.
+/// Light culling only sees these; the lights themselves stay with the caller.
+/// </summary>
+struct LightVolume
+{
+	math::vec3 position;
+	rnd::f32 range;
+};
+
+// Screen tiles of the lighting pass. Smaller than the binning tiles, so the culled
+// light lists follow the depth discontinuities more closely.
+static constexpr rnd::i32 LIGHT_TILE_SIZE = 16;
+
+static_assert(LIGHT_TILE_SIZE % rnd::framebuffer::HIZ_BLOCK == 0, "light tiles must be made of whole fast clear blocks");
+
+/// <summary>
+/// Lighting pass of one screen tile. The surfaces of the tile's covered pixels are
+/// bounded by a box, and only the lights whose volume reaches that box are passed on:
+/// shade(sample, visible) returns the color of a pixel, visible holds indices into lights.
+/// Blocks of the framebuffer still pending a clear have nothing drawn in them and are
+/// skipped; the tile's pending blocks are resolved before any pixel is shaded.
+/// Any other pixel with a depth below MAX_DEPTH is read from the G-buffer as is.
+/// Returns the number of lights left after culling.
+/// </summary>
+template <typename Shade>
+static inline size_t ShadeLightTile(rnd::i32 x0, rnd::i32 y0, rnd::i32 x1, rnd::i32 y1, const GBuffer& gbuffer, rnd::framebuffer& fb, std::span<const LightVolume> lights, std::vector<rnd::u32>& visible, Shade&& shade)
+{
+	const rnd::f32* depth_buffer = fb.depth_buffer.get();
+	rnd::color* color_buffer = fb.color_buffer.get();
+	const rnd::u32 fb_width = fb.get_width();	// the G-buffer is always row-major
+
+	math::vec3 lo(std::numeric_limits<rnd::f32>::max());
+	math::vec3 hi(-std::numeric_limits<rnd::f32>::max());
+	bool covered = false;
+
+	for (rnd::i32 y = y0; y < y1; ++y)
+	{
+		for (rnd::i32 x = x0; x < x1; ++x)
+		{
+			if ((fb.get_pending_clear(x, y) & rnd::framebuffer::CLEAR_DEPTH) || depth_buffer[fb.pixel_index(x, y)] >= MAX_DEPTH)
+				continue;
+
+			const math::vec3& p = gbuffer.position[(size_t)y * fb_width + x];
+			lo = { std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z) };
+			hi = { std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z) };
+			covered = true;
+		}
+	}
+
+	if (!covered)
+		return 0;
+
+	// sphere against box: distance from the light to the closest point of the box
+	visible.clear();
+	for (rnd::u32 i = 0; i < (rnd::u32)lights.size(); ++i)
+	{
+		const LightVolume& l = lights[i];
+		const math::vec3 d = {
+			std::max({ lo.x - l.position.x, 0.f, l.position.x - hi.x }),
+			std::max({ lo.y - l.position.y, 0.f, l.position.y - hi.y }),
+			std::max({ lo.z - l.position.z, 0.f, l.position.z - hi.z })
+		};
+
+		if (math::dot(d, d) <= l.range * l.range)
+			visible.push_back(i);
+	}
+
+	const std::span<const rnd::u32> tile_lights(visible);
+
+	// the pixels left unshaded keep the clear color
+	fb.resolve(x0, y0, x1, y1);
+
+	for (rnd::i32 y = y0; y < y1; ++y)
+	{
+		for (rnd::i32 x = x0; x < x1; ++x)
+		{
+			const size_t pixel = fb.pixel_index(x, y);
+			if (depth_buffer[pixel] >= MAX_DEPTH)
+				continue;
+
+			color_buffer[pixel] = rnd::to_color(shade(gbuffer.Read((size_t)y * fb_width + x), tile_lights));
+		}
+	}
+
+	return visible.size();
+}
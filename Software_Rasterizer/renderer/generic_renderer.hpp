@@ -8,6 +8,10 @@
 #include <functional>
 #include <span>
 #include <memory>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <deque>
 
 #include "types.hpp"
 #include "math/vector.hpp"
@@ -16,71 +20,33 @@
 #include "generic_value.hpp"
 #include "buffers.hpp"
 #include "varying.hpp"
+#include "varying_batch.hpp"
 #include "handle_manager.hpp"
 #include "frame_buffer.hpp"
+#include "triangle_setup.hpp"
+#include "clipping.hpp"
+#include "tile_rasterizer.hpp"
+#include "tile_buffer.hpp"
+#include "occlusion_buffer.hpp"
+#include "deferred.hpp"
+#include "bin_grid.hpp"
 
 #include "SimpleThreadPool.h"
 
-struct Triangle
-{
-	VSOutput v0, v1, v2;
-	rnd::f32 area;
-
-	bool culled = false;
-};
-
-struct TileRasterizerFunctor
-{
-	void operator()(int tileStartX, int tileStartY, int tileEndX, int tileEndY, const Triangle& t, rnd::color* color_buffer, rnd::f32* depth_buffer, rnd::u32 fb_width, rnd::color col)
-	{
-		// calculate the god damn triangle's bounding box here jesus christ.
-		rnd::i32 xmin = (rnd::i32)util::min3(t.v0.Position.x, t.v1.Position.x, t.v2.Position.x);
-		rnd::i32 xmax = (rnd::i32)util::max3(t.v0.Position.x, t.v1.Position.x, t.v2.Position.x);
-		rnd::i32 ymin = (rnd::i32)util::min3(t.v0.Position.y, t.v1.Position.y, t.v2.Position.y);
-		rnd::i32 ymax = (rnd::i32)util::max3(t.v0.Position.y, t.v1.Position.y, t.v2.Position.y);
-
-		// Clamp to the tile bounds.
-		xmin = std::clamp(xmin, tileStartX, tileEndX - 1);
-		xmax = std::clamp(xmax, tileStartX, tileEndX - 1);
-		ymin = std::clamp(ymin, tileStartY, tileEndY - 1);
-		ymax = std::clamp(ymax, tileStartY, tileEndY - 1);
-
-		for (int y = ymin; y <= ymax; ++y)
-		{
-			for (int x = xmin; x <= xmax; ++x)
-			{
-				math::vec4 p{ x + 0.5f, y + 0.5f, 0.f, 0.f };
-
-				float det01p = math::det_2d(t.v1.Position - t.v0.Position, p - t.v0.Position);
-				float det12p = math::det_2d(t.v2.Position - t.v1.Position, p - t.v1.Position);
-				float det20p = math::det_2d(t.v0.Position - t.v2.Position, p - t.v2.Position);
-
-				if (det01p < 0.f || det12p < 0.f || det20p < 0.f)
-					continue;
-
-				color_buffer[y * fb_width + x] = col;
-			}
-		}
-	}
-};
-
 template <typename ShaderProgram>
 struct Renderer
 {
-	static constexpr size_t MAX_TRIS = 15'000;
 	static constexpr size_t nThreads = 4;
 
+	// VSOutput, or TypedVSOutput<...> when the program declares its varyings
+	using Vertex = ShaderVertex<ShaderProgram>;
+
 	Renderer(rnd::framebuffer& fb)
 		:
 		_fb(fb),
 		_threadPool(nThreads)
 	{
-		binData = (int*)std::malloc(NUM_TX * NUM_TY * MAX_TRI_PER_TILE * sizeof(int));
-		//binCount = (std::atomic<int>*)std::calloc(NUM_TX * NUM_TY, sizeof(int));
-		binCount = std::make_unique<std::atomic<int>[]>(NUM_TX * NUM_TY);
-
-		// TODO: maybe not...
-		triangles = (Triangle*)std::malloc(MAX_TRIS * sizeof(Triangle));
+		UpdateBinGrid();
 
 		//activeTiles.reserve(NUM_TX * NUM_TY);
 	}
@@ -143,331 +109,397 @@ struct Renderer
 		_viewport = { start.x, start.y, end.x, end.y };
 	}
 
-	void DrawIndexedBin(size_t num_indices)
+	/// <summary>
+	/// Sets the size of the binning tiles, rounded up to multiples of 8. Disables auto-tuning.
+	/// </summary>
+	void SetTileSize(rnd::i32 tileW, rnd::i32 tileH)
 	{
-		assert(boundBuffer);
-		assert(boundIndexBuffer);
+		_tileSize = { BinGrid::AlignTileSize(tileW), BinGrid::AlignTileSize(tileH) };
+		_tileTuner = TileAutoTuner{};
+		UpdateBinGrid();
+	}
 
-		for (std::atomic<int>* ptr = binCount.get(), *end = binCount.get() + (NUM_TX * NUM_TY); ptr != end; ++ptr)
-			ptr->store(0, std::memory_order_relaxed);
+	math::vec2i GetTileSize() const { return _tileSize; }
 
-		const size_t nTriangles = num_indices / 3;
-		const size_t triPerThread = (nTriangles + (nThreads - 1)) / nThreads;
+	/// <summary>
+	/// Benchmarks several tile shapes over the next frames and keeps the fastest one.
+	/// Frames are delimited by EndFrame.
+	/// </summary>
+	void EnableTileAutoTune()
+	{
+		_tileTuner.Start();
+		_tileSize = _tileTuner.CurrentCandidate();
+		UpdateBinGrid();
+	}
 
-		for (int i = 0; i < nThreads; ++i)
-		{
-			const int start = i * triPerThread;
-			const int end = std::min(start + triPerThread, nTriangles);
+	/// <summary>
+	/// Switches binned draws to visibility buffer rendering. Tiles are first rasterized
+	/// depth only, recording which triangle won each pixel, then every covered pixel is
+	/// shaded once. Fragment shading no longer scales with overdraw. Immediate draws
+	/// (DrawIndexed, Draw) always shade directly.
+	/// </summary>
+	void EnableVisibilityBuffer(bool enable)
+	{
+		_visibilityEnabled = enable;
+	}
 
-			_threadPool.enqueue([this, start, end] {
-				processTriangleVertices(start, end, triangles);
-			});
-		}
+	bool IsVisibilityBufferEnabled() const { return _visibilityEnabled; }
 
-		_threadPool.waitAll();
+	/// <summary>
+	/// Deferred shading. While a G-buffer is bound, binned draws go through the visibility
+	/// buffer and write the fragment shader's surface() into the G-buffer instead of a
+	/// color. ShadeDeferred then lights it. Pass nullptr to go back to forward shading.
+	/// Immediate draws can't write the G-buffer, so none may be issued while one is bound.
+	/// </summary>
+	void BindGBuffer(GBuffer* gbuffer)
+	{
+		static_assert(DeferredFragmentShader<ShaderProgram>, "deferred shading needs a fragment shader with surface()");
+		_gbuffer = gbuffer;
+	}
 
-#if 1
+	/// <summary>
+	/// Lighting pass over the bound G-buffer, in LIGHT_TILE_SIZE screen tiles spread over the
+	/// worker threads. Every tile culls lights down to the volumes reaching its surfaces and
+	/// calls shade(const GBufferSample&, std::span&lt;const rnd::u32&gt; visible) for each covered
+	/// pixel, visible indexing lights. Run it after the frame's draws are flushed.
+	/// Every pixel with a depth is taken to hold a G-buffer sample of this frame, so all the
+	/// draws since the depth clear must have been binned draws with the G-buffer bound.
+	/// </summary>
+	template <typename Shade>
+	void ShadeDeferred(std::span<const LightVolume> lights, Shade&& shade)
+	{
+		assert(_gbuffer);
 
-		constexpr size_t TILES_PER_THREAD = 8u;
+		const rnd::i32 width = (rnd::i32)_fb.get_width();
+		const rnd::i32 height = (rnd::i32)_fb.get_height();
+		const rnd::i32 numTX = (width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+		const rnd::i32 numTiles = numTX * ((height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE);
 
-		// rasterize tiles
-		constexpr size_t totalTiles = NUM_TX * NUM_TY;
-		constexpr size_t numGroups = (totalTiles + TILES_PER_THREAD - 1) / TILES_PER_THREAD;
+		_tileCursor.store(0, std::memory_order_relaxed);
+		_lightTileCount.store(0, std::memory_order_relaxed);
 
-		for (size_t group = 0; group < numGroups; ++group)
+		for (int i = 0; i < nThreads; ++i)
 		{
-			const size_t startIdx = group * TILES_PER_THREAD;
-			const size_t endIdx = std::min(startIdx + TILES_PER_THREAD, totalTiles);
+			_threadPool.enqueue([&, this] {
+				std::vector<rnd::u32> visible;
+				size_t lightTiles = 0;
 
-			_threadPool.enqueue([this, startIdx, endIdx] {
-				for (size_t idx = startIdx; idx < endIdx; ++idx)
+				while (true)
 				{
-					// skip empty bins
-					if (binCount[idx].load(std::memory_order_relaxed) == 0)
-						continue;
-
-					const int ty = idx / NUM_TX;
-					const int tx = idx % NUM_TX;
-
-					const int tileStartX = tx * TILE_W;
-					const int tileStartY = ty * TILE_H;
-					const int tileEndX = std::min(tileStartX + TILE_W, W);
-					const int tileEndY = std::min(tileStartY + TILE_H, H);
-
-					for (int bi = 0, n = binCount[idx].load(); bi < n; ++bi)
-					{
-						TileRasterizerFunctor()(
-							tileStartX, tileStartY,
-							tileEndX, tileEndY,
-							triangles[binData[idx * MAX_TRI_PER_TILE + bi]],
-							_fb.color_buffer.get(),
-							_fb.depth_buffer.get(),
-							_fb.get_width(),
-							rnd::red
-						);
-					}
+					const size_t idx = _tileCursor.fetch_add(1, std::memory_order_relaxed);
+					if (idx >= (size_t)numTiles)
+						break;
+
+					const rnd::i32 x0 = ((rnd::i32)idx % numTX) * LIGHT_TILE_SIZE;
+					const rnd::i32 y0 = ((rnd::i32)idx / numTX) * LIGHT_TILE_SIZE;
+
+					lightTiles += ShadeLightTile(
+						x0, y0,
+						std::min(x0 + LIGHT_TILE_SIZE, width), std::min(y0 + LIGHT_TILE_SIZE, height),
+						*_gbuffer,
+						_fb,
+						lights,
+						visible,
+						shade
+					);
 				}
+
+				_lightTileCount.fetch_add(lightTiles, std::memory_order_relaxed);
 			});
 		}
+
 		_threadPool.waitAll();
+	}
 
-#else
-		// old
-		for (int ty = 0; ty < NUM_TY; ++ty)
-		{
-			for (int tx = 0; tx < NUM_TX; ++tx)
-			{
-				int idx = ty * NUM_TX + tx;
-				if (binCount[idx] > 0)
-				{
-					int tileStartX = tx * TILE_W;
-					int tileStartY = ty * TILE_H;
-					int tileEndX = std::min(tileStartX + TILE_W, W);
-					int tileEndY = std::min(tileStartY + TILE_H, H);
-
-					std::vector<Triangle> tris;
-					tris.reserve(binCount[idx]);
-					for (int bi = 0; bi < binCount[idx].load(); ++bi)
-					{
-						const Triangle& t = triangles[binData[idx * MAX_TRI_PER_TILE + bi]];
-						tris.push_back(t);
-					}
+	// Sum over the screen tiles of the lights each one kept in the last ShadeDeferred.
+	size_t GetLightTileCount() const { return _lightTileCount.load(std::memory_order_relaxed); }
 
-					TileRasterizerFunctor()(tileStartX, tileStartY, tileEndX, tileEndY, std::move(tris), _fb.color_buffer.get(), _fb.depth_buffer.get(), _fb.get_width());
-				}
-			}
+	/// <summary>
+	/// Starts recording a frame. Until EndFrame, DrawIndexedBin only records the draw
+	/// (bound buffers and a snapshot of the shader program) and the whole frame is
+	/// binned and rasterized once in EndFrame.
+	/// </summary>
+	void BeginFrame()
+	{
+		_recording = true;
+		clearDraws();
+
+		_occlusion.Clear();
+		_occlusionStats = {};
+	}
+
+	void EndFrame()
+	{
+		if (_recording)
+		{
+			_recording = false;
+			flushDraws();
 		}
 
-#endif
-		
+		// queries answer for the frame that just ended
+		for (OcclusionQuery& q : _queries)
+			q.result = q.samples.exchange(0, std::memory_order_relaxed);
+
+		if (_tileTuner.IsActive())
+		{
+			_tileSize = _tileTuner.EndFrame();
+			UpdateBinGrid();
+		}
 	}
-	void DrawIndexed(size_t num_indices)
+
+	/// <summary>
+	/// Rasterizes the bound mesh into the occlusion buffer only, with the bound program's
+	/// vertex shader (its position() alone when it has one). Draw occluders after BeginFrame
+	/// and before the draws they should hide; they still have to be drawn normally to be visible.
+	/// The occlusion buffer is cleared by BeginFrame, so occluders only exist inside a frame.
+	/// </summary>
+	void DrawOccluder(size_t num_indices)
 	{
 		assert(boundBuffer);
 		assert(boundIndexBuffer);
+		assert(_recording && "occluders are drawn between BeginFrame and EndFrame");
 
-		size_t nTriangles = num_indices / 3;
+		DrawCommand cmd;
+		cmd.vertexBuffer = boundBuffer;
+		cmd.indexBuffer = boundIndexBuffer;
+		cmd.program = program;
+		cmd.numTriangles = num_indices / 3;
 
-		// for each triangle
-		for (int i = 0; i < nTriangles; ++i)
+		_occluderUsed.clear();
+		cmd.numVertices = markUsedVertices(cmd, _occluderUsed);
+
+		if (_occluderPositions.size() < cmd.numVertices)
+			_occluderPositions.resize(cmd.numVertices);
+
+		shadePositions(cmd, _occluderUsed.data(), _occluderPositions.data());
+
+		for (size_t i = 0; i < cmd.numTriangles; ++i)
 		{
-			VSInput input0{};
-			VSInput input1{};
-			VSInput input2{};
+			const rnd::u16* indices = boundIndexBuffer->data + i * 3;
+			_occlusion.RasterizeTriangle(_occluderPositions[indices[0]], _occluderPositions[indices[1]], _occluderPositions[indices[2]]);
+		}
+	}
 
-			const rnd::u16 idx0 = boundIndexBuffer->data[i * 3 + 0];
-			const rnd::u16 idx1 = boundIndexBuffer->data[i * 3 + 1];
-			const rnd::u16 idx2 = boundIndexBuffer->data[i * 3 + 2];
+	/// <summary>
+	/// Object space bounds of the next draw and the matrix taking them to clip space. The
+	/// next Draw, DrawIndexed or DrawIndexedBin is skipped, before any vertex is shaded, when
+	/// the bounds are hidden behind the occluders drawn so far in the frame.
+	/// </summary>
+	void SetDrawBounds(const gfx::aabb& bounds, const math::mat4& model_view_proj)
+	{
+		assert(_recording && "draw bounds are tested against the occluders of the current frame");
 
-			// for each attribute in the vertex
-			for (const VertexAttrib& a : boundBuffer->get_attribs())
-			{
-				const uint8_t* ptr0 = boundBuffer->get_data() + boundBuffer->get_stride() * idx0 + a.offset;
-				const uint8_t* ptr1 = boundBuffer->get_data() + boundBuffer->get_stride() * idx1 + a.offset;
-				const uint8_t* ptr2 = boundBuffer->get_data() + boundBuffer->get_stride() * idx2 + a.offset;
+		_drawBounds = bounds;
+		_drawModelViewProj = model_view_proj;
+		_hasDrawBounds = true;
+	}
 
-				const GenericValue val0 = extract_vertex_attribute(ptr0, a);
-				const GenericValue val1 = extract_vertex_attribute(ptr1, a);
-				const GenericValue val2 = extract_vertex_attribute(ptr2, a);
+	const OcclusionBuffer& GetOcclusionBuffer() const { return _occlusion; }
+	const OcclusionStats& GetOcclusionStats() const { return _occlusionStats; }
 
-				input0.Set(a.slot, val0);
-				input1.Set(a.slot, val1);
-				input2.Set(a.slot, val2);
-			}
+	/// <summary>
+	/// Occlusion queries count the samples that pass the depth test in the draws issued
+	/// between BeginOcclusionQuery and EndOcclusionQuery. The count becomes available
+	/// through GetOcclusionQueryResult once the frame ends, typically to decide what to
+	/// draw in the next frame. Draws skipped by occlusion culling count zero samples.
+	/// </summary>
+	rnd::u32 CreateOcclusionQuery()
+	{
+		_queries.emplace_back();
+		return (rnd::u32)(_queries.size() - 1);
+	}
 
-			VSOutput vsout[3];
+	void BeginOcclusionQuery(rnd::u32 query)
+	{
+		assert(query < _queries.size());
+		assert(_activeQuery < 0 && "occlusion queries can't be nested");
+		_activeQuery = (rnd::i32)query;
+	}
 
-			// vertex shader
-			vsout[0] = program->vs(input0);
-			vsout[1] = program->vs(input1);
-			vsout[2] = program->vs(input2);
+	void EndOcclusionQuery()
+	{
+		_activeQuery = -1;
+	}
 
-			// perspective division and viewport trasnform
-			vsout[0].Position = _viewport.transform(perspective_divide(vsout[0].Position));
-			vsout[1].Position = _viewport.transform(perspective_divide(vsout[1].Position));
-			vsout[2].Position = _viewport.transform(perspective_divide(vsout[2].Position));
+	// Visible samples of the query in the last frame that ended.
+	rnd::u64 GetOcclusionQueryResult(rnd::u32 query) const
+	{
+		assert(query < _queries.size());
+		return _queries[query].result;
+	}
 
-			// perspective correction
-			std::size_t sz = vsout->Size();
-			for (int j = 0; j < sz; ++j)
-			{
-				GenericValue& gv0 = vsout[0].varyings[j];
-				GenericValue& gv1 = vsout[1].varyings[j];
-				GenericValue& gv2 = vsout[2].varyings[j];
+	void DrawIndexedBin(size_t num_indices)
+	{
+		assert(boundBuffer);
+		assert(boundIndexBuffer);
 
-				const std::size_t sz = gv0.count;
-				for (int j = 0; j < sz; ++j)
-				{
-					gv0.vals[j] = gv0.vals[j] * vsout[0].Position.w;
-					gv1.vals[j] = gv1.vals[j] * vsout[1].Position.w;
-					gv2.vals[j] = gv2.vals[j] * vsout[2].Position.w;
-				}
-			}
+		if (drawOccluded(num_indices / 3))
+			return;
 
-			rnd::f32 area = math::det_2d(
-				vsout[1].Position - vsout[0].Position,
-				vsout[2].Position - vsout[0].Position
-			);
+		if (!_recording)
+			clearDraws();
 
-			// backface culling
-			const rnd::b8 ccw = area < 0.f;
-			if (!ccw)
-				continue;
-			std::swap(vsout[1], vsout[2]);
-			area = -area;
+		DrawCommand cmd;
+		cmd.vertexBuffer = boundBuffer;
+		cmd.indexBuffer = boundIndexBuffer;
+		cmd.vp = _viewport;
+		cmd.guardBand = GuardBand::For(_viewport);
+		cmd.firstTriangle = _drawTriangles;
+		cmd.numTriangles = num_indices / 3;
+		cmd.query = _activeQuery;
 
-			//draw_triangle_basic(vsout[0], vsout[1], vsout[2], area);
-			draw_triangle_basic_test(vsout[0], vsout[1], vsout[2], area);
-		}
+		// uniforms may change between draws of the same frame, so keep a copy when we can
+		if constexpr (std::is_copy_constructible_v<ShaderProgram>)
+			cmd.program = &_programSnapshots.emplace_back(*program);
+		else
+			cmd.program = program;
+
+		_draws.push_back(cmd);
+		_drawTriangles += cmd.numTriangles;
 
+		if (!_recording)
+			flushDraws();
 	}
 
-	void Draw(size_t num_vertices)
+	void DrawIndexed(size_t num_indices)
 	{
 		assert(boundBuffer);
-		const std::vector<VertexAttrib>& attributes = boundBuffer->get_attribs();
-
-		size_t nTriangles = num_vertices / 3;
-
-		// for each triangle
-		for (int i = 0; i < nTriangles; ++i)
-		{
-			VSInput input0{};
-			VSInput input1{};
-			VSInput input2{};
+		assert(boundIndexBuffer);
+		assert(!_gbuffer && "immediate draws don't write the G-buffer");
 
-			// for each attribute in the vertex
-			for (const VertexAttrib& a : attributes)
-			{
-				uint8_t* ptr0 = boundBuffer->data + boundBuffer->stride * (3 * i) + a.offset;
-				uint8_t* ptr1 = ptr0 + boundBuffer->stride;
-				uint8_t* ptr2 = ptr1 + boundBuffer->stride;
+		if (drawOccluded(num_indices / 3))
+			return;
 
-				GenericValue val0 = ExtractValue(ptr0, a);
-				GenericValue val1 = ExtractValue(ptr1, a);
-				GenericValue val2 = ExtractValue(ptr2, a);
+		DrawCommand cmd;
+		cmd.vertexBuffer = boundBuffer;
+		cmd.indexBuffer = boundIndexBuffer;
+		cmd.program = program;
+		cmd.vp = _viewport;
+		cmd.guardBand = GuardBand::For(_viewport);
+		cmd.numTriangles = num_indices / 3;
 
-				input0.Set(a.slot, val0);
-				input1.Set(a.slot, val1);
-				input2.Set(a.slot, val2);
-			}
+		// shade every referenced vertex once
+		_immediateUsed.clear();
+		cmd.numVertices = markUsedVertices(cmd, _immediateUsed);
 
-			VSOutput vsout[3];
-			vsout[0] = program->vs(input0);
-			vsout[1] = program->vs(input1);
-			vsout[2] = program->vs(input2);
+		reserveImmediateVertices(cmd.numVertices);
+		Vertex* vertices = _immediateVertices.data();
+		ScreenVertex* screen = _immediateScreen.data();
+		shadeVertices(cmd, 0, cmd.numVertices, _immediateUsed.data(), vertices, screen);
 
-			vsout[0].Position = _viewport.transform(perspective_divide( vsout[0].Position ));
-			vsout[1].Position = _viewport.transform(perspective_divide( vsout[1].Position ));
-			vsout[2].Position = _viewport.transform(perspective_divide( vsout[2].Position ));
+		Triangle<Vertex> t;
+		AttributePlane planes[MaxVaryingFloats<Vertex>];
+		rnd::u64 samples = 0;
 
-			rnd::f32 area = math::det_2d(
-				vsout[1].Position - vsout[0].Position,
-				vsout[2].Position - vsout[0].Position
-			);
+		auto drawClipped = [this, &samples](const Triangle<Vertex>& piece, const AttributePlane* piecePlanes) {
+			samples += draw_triangle_basic(piece, piecePlanes);
+		};
 
-			// backface culling
-			const rnd::b8 ccw = area < 0.f;
-			if (!ccw)
-				continue;
-			std::swap(vsout[1], vsout[2]);
-			area = -area;
+		// for each triangle
+		for (size_t i = 0; i < cmd.numTriangles; ++i)
+		{
+			const rnd::u16* indices = boundIndexBuffer->data + i * 3;
 
-			draw_triangle_basic(vsout[0], vsout[1], vsout[2], area);
+			if (setupTriangle(cmd, vertices, screen, indices[0], indices[1], indices[2], t, planes, drawClipped))
+				samples += draw_triangle_basic(t, planes);
 		}
+
+		addQuerySamples(_activeQuery, samples);
 	}
 
-private:
-	void draw_triangle_basic_test(VSOutput& v0, VSOutput& v1, VSOutput& v2, rnd::f32 area)
+	void Draw(size_t num_vertices)
 	{
-		rnd::f32 rcp_area = 1.f / area;
+		assert(boundBuffer);
+		assert(!_gbuffer && "immediate draws don't write the G-buffer");
 
-		rnd::i32 xmin = (rnd::i32)util::min3(v0.Position.x, v1.Position.x, v2.Position.x);
-		rnd::i32 xmax = (rnd::i32)util::max3(v0.Position.x, v1.Position.x, v2.Position.x);
-		rnd::i32 ymin = (rnd::i32)util::min3(v0.Position.y, v1.Position.y, v2.Position.y);
-		rnd::i32 ymax = (rnd::i32)util::max3(v0.Position.y, v1.Position.y, v2.Position.y);
+		if (drawOccluded(num_vertices / 3))
+			return;
 
-		// Clamp to viewport bounds.
-		xmin = std::clamp(xmin, _viewport.xmin, _viewport.xmax - 1);
-		xmax = std::clamp(xmax, _viewport.xmin, _viewport.xmax - 1);
-		ymin = std::clamp(ymin, _viewport.ymin, _viewport.ymax - 1);
-		ymax = std::clamp(ymax, _viewport.ymin, _viewport.ymax - 1);
+		DrawCommand cmd;
+		cmd.vertexBuffer = boundBuffer;
+		cmd.program = program;
+		cmd.vp = _viewport;
+		cmd.guardBand = GuardBand::For(_viewport);
+		cmd.numTriangles = num_vertices / 3;
+		cmd.numVertices = cmd.numTriangles * 3;
 
-		for (rnd::i32 y = ymin; y <= ymax; ++y)
-		{
-			for (rnd::i32 x = xmin; x <= xmax; ++x)
-			{
-				math::vec4 p{ x + 0.5f, y + 0.5f, 0.f, 0.f };
+		// non-indexed, every vertex belongs to exactly one triangle
+		_immediateUsed.assign(cmd.numVertices, 1);
 
-				float det01p = math::det_2d(v1.Position - v0.Position, p - v0.Position);
-				float det12p = math::det_2d(v2.Position - v1.Position, p - v1.Position);
-				float det20p = math::det_2d(v0.Position - v2.Position, p - v2.Position);
+		reserveImmediateVertices(cmd.numVertices);
+		Vertex* vertices = _immediateVertices.data();
+		ScreenVertex* screen = _immediateScreen.data();
+		shadeVertices(cmd, 0, (rnd::u32)cmd.numVertices, _immediateUsed.data(), vertices, screen);
 
-				if (det01p < 0.f || det12p < 0.f || det20p < 0.f)
-					continue;
+		Triangle<Vertex> t;
+		AttributePlane planes[MaxVaryingFloats<Vertex>];
+		rnd::u64 samples = 0;
 
-				_fb.put_pixel((int)x, (int)y, rnd::green);
-			}
+		auto drawClipped = [this, &samples](const Triangle<Vertex>& piece, const AttributePlane* piecePlanes) {
+			samples += draw_triangle_basic(piece, piecePlanes);
+		};
+
+		// for each triangle
+		for (rnd::u32 i = 0; i < cmd.numTriangles; ++i)
+		{
+			if (setupTriangle(cmd, vertices, screen, 3 * i, 3 * i + 1, 3 * i + 2, t, planes, drawClipped))
+				samples += draw_triangle_basic(t, planes);
 		}
+
+		addQuerySamples(_activeQuery, samples);
 	}
-	void draw_triangle_basic(VSOutput& v0, VSOutput& v1, VSOutput& v2, rnd::f32 area)
-	{
-		rnd::f32 rcp_area = 1.f / area;
 
-		rnd::i32 xmin = (rnd::i32)util::min3(v0.Position.x, v1.Position.x, v2.Position.x);
-		rnd::i32 xmax = (rnd::i32)util::max3(v0.Position.x, v1.Position.x, v2.Position.x);
-		rnd::i32 ymin = (rnd::i32)util::min3(v0.Position.y, v1.Position.y, v2.Position.y);
-		rnd::i32 ymax = (rnd::i32)util::max3(v0.Position.y, v1.Position.y, v2.Position.y);
+private:
+	// Returns the number of samples that passed the depth test.
+	rnd::u32 draw_triangle_basic(const Triangle<Vertex>& t, const AttributePlane* planes)
+	{
+		const TriangleSetup& ts = t.setup;
 
 		// Clamp to viewport bounds.
-		xmin = std::clamp(xmin, _viewport.xmin, _viewport.xmax - 1);
-		xmax = std::clamp(xmax, _viewport.xmin, _viewport.xmax - 1);
-		ymin = std::clamp(ymin, _viewport.ymin, _viewport.ymax - 1);
-		ymax = std::clamp(ymax, _viewport.ymin, _viewport.ymax - 1);
+		const rnd::i32 xmin = std::max(ts.xmin, _viewport.xmin);
+		const rnd::i32 xmax = std::min(ts.xmax, _viewport.xmax - 1);
+		const rnd::i32 ymin = std::max(ts.ymin, _viewport.ymin);
+		const rnd::i32 ymax = std::min(ts.ymax, _viewport.ymax - 1);
+
+		rnd::i64 w0_row = ts.e12.Evaluate(xmin, ymin);
+		rnd::i64 w1_row = ts.e20.Evaluate(xmin, ymin);
+		rnd::i64 w2_row = ts.e01.Evaluate(xmin, ymin);
+
+		rnd::u32 samples = 0;
 
 		for (rnd::i32 y = ymin; y <= ymax; ++y)
 		{
-			for (rnd::i32 x = xmin; x <= xmax; ++x)
-			{
-				math::vec4 p{ x + 0.5f, y + 0.5f, 0.f, 0.f };
+			rnd::i64 w0 = w0_row;
+			rnd::i64 w1 = w1_row;
+			rnd::i64 w2 = w2_row;
 
-				float det01p = math::det_2d(v1.Position - v0.Position, p - v0.Position);
-				float det12p = math::det_2d(v2.Position - v1.Position, p - v1.Position);
-				float det20p = math::det_2d(v0.Position - v2.Position, p - v2.Position);
+			const rnd::f32 fy = (rnd::f32)(y - ts.ymin);
 
-				if (det01p < 0.f || det12p < 0.f || det20p < 0.f)
+			for (rnd::i32 x = xmin; x <= xmax; ++x, w0 += ts.e12.A, w1 += ts.e20.A, w2 += ts.e01.A)
+			{
+				if ((w0 | w1 | w2) < 0)
 					continue;
 
-				float alpha = det12p * rcp_area;
-				float beta = det20p * rcp_area;
-				float gamma = det01p * rcp_area;
-
-				float oneOverZ = alpha * v0.Position.w + beta * v1.Position.w + gamma * v2.Position.w;
-				float z = 1.f / oneOverZ;
+				const rnd::f32 fx = (rnd::f32)(x - ts.xmin);
+				const rnd::f32 z = 1.f / t.position[3].At(fx, fy);
 
 				if (z >= _fb.get_depth(x, y))
 					continue;
 				_fb.set_depth(x, y, z);
+				++samples;
 
-				VSOutput interpolated;
-				interpolated.Position = (v0.Position * alpha + v1.Position * beta + v2.Position * gamma) * z;
-
-				// for each vertex attribute
-				for (int j = 0; j < v0.Size(); ++j)
-				{
-					const GenericValue& a0 = v0.varyings[j];
-					const GenericValue& a1 = v1.varyings[j];
-					const GenericValue& a2 = v2.varyings[j];
-
-					GenericValue interp = Interpolate(a0, a1, a2, alpha, beta, gamma, z);
-					interpolated.varyings[j] = interp;
-				}
-
+				const Vertex interpolated = InterpolatePlanes(t, planes, fx, fy, z);
 				math::vec4 color = program->fs(interpolated);
 
 				_fb.put_pixel((int)x, (int)y, rnd::to_color(color));
 			}
+
+			w0_row += ts.e12.B;
+			w1_row += ts.e20.B;
+			w2_row += ts.e01.B;
 		}
+
+		return samples;
 	}
 	inline static math::vec4 perspective_divide(math::vec4 v)
 	{
@@ -479,87 +511,564 @@ private:
 	}
 private:
 
-	// instance data:
-	// 1. boundIndexBuffer
-	// 2. boundBuffer
-	// 3. shaderProgram
-	// 4. viewport
-	void processTriangleVertices(int startRange, int endRange, Triangle* out)
+	struct DrawCommand
+	{
+		const VertexBuffer* vertexBuffer = nullptr;
+		const IndexBuffer* indexBuffer = nullptr;
+		const ShaderProgram* program = nullptr;
+		viewport vp = { 0 };
+		size_t firstTriangle = 0;	// into the frame's triangle array
+		size_t numTriangles = 0;
+		size_t firstVertex = 0;		// into the frame's shaded vertex array
+		size_t numVertices = 0;		// highest referenced index + 1
+		size_t firstPlane = 0;		// into the frame's varying plane array
+		size_t planeStride = 0;		// varying planes per triangle
+		GuardBand guardBand;
+		rnd::i32 query = -1;		// occlusion query counting the draw's samples, if any
+	};
+
+	struct OcclusionQuery
+	{
+		std::atomic<rnd::u64> samples = 0;	// accumulated by the raster workers during the frame
+		rnd::u64 result = 0;				// samples of the last finished frame
+	};
+
+	// Tests and consumes the bounds given by SetDrawBounds. True when the draw is hidden.
+	bool drawOccluded(size_t numTriangles)
+	{
+		if (!_hasDrawBounds)
+			return false;
+
+		_hasDrawBounds = false;
+		++_occlusionStats.drawsTested;
+
+		if (_occlusion.IsVisible(_drawBounds, _drawModelViewProj))
+			return false;
+
+		++_occlusionStats.drawsCulled;
+		_occlusionStats.trianglesCulled += numTriangles;
+		return true;
+	}
+
+	void addQuerySamples(rnd::i32 query, rnd::u64 samples)
+	{
+		if (query >= 0 && samples > 0)
+			_queries[query].samples.fetch_add(samples, std::memory_order_relaxed);
+	}
+
+	// Triangles made by clipping, owned by the assembly thread that clipped them.
+	struct ClippedTriangles
 	{
-		for (int i = startRange; i < endRange; ++i)
+		std::vector<Triangle<Vertex>> triangles;
+		std::vector<AttributePlane> planes;
+
+		void Clear()
 		{
-			VSInput input0{};
-			VSInput input1{};
-			VSInput input2{};
+			triangles.clear();
+			planes.clear();
+		}
+	};
 
-			const rnd::u16 idx0 = boundIndexBuffer->data[i * 3 + 0];
-			const rnd::u16 idx1 = boundIndexBuffer->data[i * 3 + 1];
-			const rnd::u16 idx2 = boundIndexBuffer->data[i * 3 + 2];
+	// Flags the vertices referenced by the draw's indices and returns the vertex count it needs.
+	static size_t markUsedVertices(const DrawCommand& cmd, std::vector<rnd::u8>& used, size_t offset = 0)
+	{
+		const rnd::u16* indices = cmd.indexBuffer->data;
+		const size_t numIndices = cmd.numTriangles * 3;
 
-			for (const VertexAttrib& a : boundBuffer->get_attribs())
-			{
-				const uint8_t* ptr0 = boundBuffer->get_data() + boundBuffer->get_stride() * idx0 + a.offset;
-				const uint8_t* ptr1 = boundBuffer->get_data() + boundBuffer->get_stride() * idx1 + a.offset;
-				const uint8_t* ptr2 = boundBuffer->get_data() + boundBuffer->get_stride() * idx2 + a.offset;
+		rnd::u16 maxIndex = 0;
+		for (size_t i = 0; i < numIndices; ++i)
+			maxIndex = std::max(maxIndex, indices[i]);
+
+		const size_t numVertices = numIndices ? (size_t)maxIndex + 1 : 0;
+		used.resize(offset + numVertices, 0);
 
-				const GenericValue val0 = extract_vertex_attribute(ptr0, a);
-				const GenericValue val1 = extract_vertex_attribute(ptr1, a);
-				const GenericValue val2 = extract_vertex_attribute(ptr2, a);
+		for (size_t i = 0; i < numIndices; ++i)
+			used[offset + indices[i]] = 1;
 
-				input0.Set(a.slot, val0);
-				input1.Set(a.slot, val1);
-				input2.Set(a.slot, val2);
+		return numVertices;
+	}
+
+	// Fetch, vertex shader, perspective divide, viewport transform and perspective correction
+	// for the flagged vertices in [first, last) of the draw (indices local to the draw).
+	// None of it depends on the triangle, so each vertex is shaded once and shared by its triangles.
+	// Programs whose vertex shader accepts a VSInputBatch are run 8 vertices per call.
+	static void shadeVertices(const DrawCommand& cmd, rnd::u32 first, rnd::u32 last, const rnd::u8* used, Vertex* out, ScreenVertex* screen)
+	{
+		const VertexBuffer* vb = cmd.vertexBuffer;
+
+		if constexpr (BatchedVertexShader<ShaderProgram> && std::is_same_v<Vertex, VSOutput>)
+		{
+			rnd::u32 lanes[VSInputBatch::WIDTH];
+			size_t n = 0;
+
+			auto runBatch = [&]() {
+				VSInputBatch input;
+				input.count = n;
+
+				// pad the tail with the last vertex so every lane holds valid data
+				for (size_t lane = 0; lane < VSInputBatch::WIDTH; ++lane)
+				{
+					const rnd::u32 index = lanes[std::min(lane, n - 1)];
+					for (const VertexAttrib& a : vb->get_attribs())
+					{
+						const uint8_t* ptr = vb->get_data() + vb->get_stride() * index + a.offset;
+						input.Set(a.slot, lane, extract_vertex_attribute(ptr, a));
+					}
+				}
+
+				const VSOutputBatch batch = cmd.program->vs(input);
+
+				for (size_t lane = 0; lane < n; ++lane)
+				{
+					Vertex& o = out[lanes[lane]];
+					batch.Extract(lane, o);
+					finishVertex(cmd, o, screen[lanes[lane]]);
+				}
+				n = 0;
+			};
+
+			for (rnd::u32 v = first; v < last; ++v)
+			{
+				if (!used[v])
+					continue;
+
+				lanes[n++] = v;
+				if (n == VSInputBatch::WIDTH)
+					runBatch();
 			}
 
-			VSOutput vsout[3];
+			if (n > 0)
+				runBatch();
+		}
+		else
+		{
+			for (rnd::u32 v = first; v < last; ++v)
+			{
+				if (!used[v])
+					continue;
 
-			// vertex shader
-			vsout[0] = program->vs(input0);
-			vsout[1] = program->vs(input1);
-			vsout[2] = program->vs(input2);
+				VSInput input{};
+				for (const VertexAttrib& a : vb->get_attribs())
+				{
+					const uint8_t* ptr = vb->get_data() + vb->get_stride() * v + a.offset;
+					input.Set(a.slot, extract_vertex_attribute(ptr, a));
+				}
 
-			// perspective division and viewport trasnform
-			vsout[0].Position = _viewport.transform(perspective_divide(vsout[0].Position));
-			vsout[1].Position = _viewport.transform(perspective_divide(vsout[1].Position));
-			vsout[2].Position = _viewport.transform(perspective_divide(vsout[2].Position));
+				out[v] = cmd.program->vs(input);
+				finishVertex(cmd, out[v], screen[v]);
+			}
+		}
+	}
+
+	// Clip space positions of the flagged vertices of the draw, for occluders. Programs with a
+	// position-only vertex shader skip the varyings, the others run their full vertex shader.
+	static void shadePositions(const DrawCommand& cmd, const rnd::u8* used, math::vec4* out)
+	{
+		const VertexBuffer* vb = cmd.vertexBuffer;
+
+		for (rnd::u32 v = 0; v < cmd.numVertices; ++v)
+		{
+			if (!used[v])
+				continue;
 
-			// perspective correction
-			const std::size_t sz = vsout->Size();
-			for (int j = 0; j < sz; ++j)
+			VSInput input{};
+			for (const VertexAttrib& a : vb->get_attribs())
 			{
-				GenericValue& gv0 = vsout[0].varyings[j];
-				GenericValue& gv1 = vsout[1].varyings[j];
-				GenericValue& gv2 = vsout[2].varyings[j];
+				const uint8_t* ptr = vb->get_data() + vb->get_stride() * v + a.offset;
+				input.Set(a.slot, extract_vertex_attribute(ptr, a));
+			}
+
+			if constexpr (PositionVertexShader<ShaderProgram>)
+				out[v] = cmd.program->vs.position(input);
+			else
+				out[v] = cmd.program->vs(input).Position;
+		}
+	}
+
+	// Outcode and screen space position of a shaded vertex. The vertex itself stays in
+	// clip space so triangles crossing the near plane can still be clipped.
+	static void finishVertex(const DrawCommand& cmd, const Vertex& v, ScreenVertex& out)
+	{
+		out.outcode = ComputeOutcode(v.Position, cmd.guardBand);
+		out.position = cmd.vp.transform(perspective_divide(v.Position));
+	}
+
+	// Culls, clips and sets up the triangle (i0, i1, i2) of a draw. A triangle that needs no
+	// clipping is set up in t and planes and true is returned. Otherwise the pieces left after
+	// clipping are set up one by one in scratch storage and passed to emitClipped(piece, planes).
+	template <typename EmitClipped>
+	static bool setupTriangle(const DrawCommand& cmd, const Vertex* vertices, const ScreenVertex* screen, rnd::u32 i0, rnd::u32 i1, rnd::u32 i2, Triangle<Vertex>& t, AttributePlane* planes, EmitClipped&& emitClipped)
+	{
+		const rnd::u16 c0 = screen[i0].outcode;
+		const rnd::u16 c1 = screen[i1].outcode;
+		const rnd::u16 c2 = screen[i2].outcode;
+
+		// trivial reject: all three vertices are outside the same frustum plane
+		if (c0 & c1 & c2 & CLIP_REJECT_MASK)
+			return false;
+
+		t.layout = VaryingLayout<Vertex>::Of(vertices[i0]);
+		const size_t numFloats = t.layout.NumFloats();
+
+		// trivial accept: in front of the near plane and inside the guard band
+		const rnd::u16 clipCodes = (c0 | c1 | c2) & CLIP_PLANES_MASK;
+		if (clipCodes == 0)
+		{
+			const math::vec4& p0 = screen[i0].position;
+			const math::vec4& p1 = screen[i2].position;
+			const math::vec4& p2 = screen[i1].position;
+
+			if (!setupEdges(cmd.vp, t, p0, p1, p2))
+				return false;
+
+			rnd::f32 f0[MaxVaryingFloats<Vertex>], f1[MaxVaryingFloats<Vertex>], f2[MaxVaryingFloats<Vertex>];
+			t.layout.Gather(vertices[i0], f0);
+			t.layout.Gather(vertices[i2], f1);
+			t.layout.Gather(vertices[i1], f2);
+
+			SetupPlanes(t, p0, p1, p2, f0, f1, f2, planes);
+			return true;
+		}
+
+		ClipPolygon<Vertex> poly;
+		const rnd::u32 indices[3] = { i0, i1, i2 };
+		for (size_t k = 0; k < 3; ++k)
+		{
+			poly.points[k].position = vertices[indices[k]].Position;
+			t.layout.Gather(vertices[indices[k]], poly.points[k].varyings);
+		}
+		poly.count = 3;
+
+		if (ClipPolygonPlanes(poly, clipCodes, cmd.guardBand, numFloats) < 3)
+			return false;
+
+		math::vec4 positions[MAX_CLIP_VERTICES];
+		for (size_t k = 0; k < poly.count; ++k)
+			positions[k] = cmd.vp.transform(perspective_divide(poly.points[k].position));
+
+		Triangle<Vertex> piece;
+		piece.draw = t.draw;
+		piece.layout = t.layout;
+
+		AttributePlane piecePlanes[MaxVaryingFloats<Vertex>];
+
+		// the polygon is convex, fan it out from the first vertex
+		for (size_t k = 1; k + 1 < poly.count; ++k)
+		{
+			if (!setupEdges(cmd.vp, piece, positions[0], positions[k + 1], positions[k]))
+				continue;
+
+			SetupPlanes(piece, positions[0], positions[k + 1], positions[k],
+				poly.points[0].varyings, poly.points[k + 1].varyings, poly.points[k].varyings, piecePlanes);
+			emitClipped(piece, piecePlanes);
+		}
+
+		return false;
+	}
+
+	// Cull stage of a triangle that needs no (more) clipping, on screen positions only:
+	// rejects backfacing, zero area and off viewport triangles, then snaps the rest and
+	// sets up their edges. Runs before any varying is read, so rejected triangles cost no
+	// attribute traffic. The vertices come with the winding already flipped for SetupTriangle.
+	static bool setupEdges(const viewport& vp, Triangle<Vertex>& t, const math::vec4& p0, const math::vec4& p1, const math::vec4& p2)
+	{
+		// backface culling, on the submitted winding; also drops zero area
+		const rnd::f32 area = math::det_2d(p2 - p0, p1 - p0);
+		const rnd::b8 ccw = area < 0.f;
+		if (!ccw)
+			return false;
+
+		// entirely outside the viewport, which the frustum outcodes miss near the corners
+		if (std::max({ p0.x, p1.x, p2.x }) < (rnd::f32)vp.xmin || std::min({ p0.x, p1.x, p2.x }) > (rnd::f32)vp.xmax ||
+			std::max({ p0.y, p1.y, p2.y }) < (rnd::f32)vp.ymin || std::min({ p0.y, p1.y, p2.y }) > (rnd::f32)vp.ymax)
+			return false;
+
+		if (!SetupTriangle(p0, p1, p2, t.setup))
+			return false;
+
+		t.small = IsSmallTriangle(t.setup);
+		return true;
+	}
+
+	void clearDraws()
+	{
+		_draws.clear();
+		_programSnapshots.clear();
+		_drawTriangles = 0;
+	}
+
+	// Grows the scratch of the immediate draws to hold the vertices of one draw.
+	void reserveImmediateVertices(size_t numVertices)
+	{
+		if (_immediateVertices.size() < numVertices)
+		{
+			_immediateVertices.resize(numVertices);
+			_immediateScreen.resize(numVertices);
+		}
+	}
+
+	// Shades the vertices of every recorded draw, assembles and bins the whole frame and
+	// rasterizes each tile once. Three fork/join barriers regardless of the draw count.
+	void flushDraws()
+	{
+		if (_draws.empty())
+			return;
+
+		const auto startTime = std::chrono::steady_clock::now();
+
+		// picks up framebuffer resets and tile size changes
+		UpdateBinGrid();
+
+		// vertex stage: shade the vertices referenced by each draw once
+		_vertexUsed.clear();
+
+		size_t nVertices = 0;
+		for (DrawCommand& cmd : _draws)
+		{
+			cmd.firstVertex = nVertices;
+			cmd.numVertices = markUsedVertices(cmd, _vertexUsed, nVertices);
+			nVertices += cmd.numVertices;
+		}
+
+		if (_vertices.size() < nVertices)
+		{
+			_vertices.resize(nVertices);
+			_screen.resize(nVertices);
+		}
+
+		const size_t vertPerThread = (nVertices + (nThreads - 1)) / nThreads;
+
+		for (int i = 0; i < nThreads; ++i)
+		{
+			const size_t start = std::min(i * vertPerThread, nVertices);
+			const size_t end = std::min(start + vertPerThread, nVertices);
+
+			_threadPool.enqueue([this, start, end] {
+				for (const DrawCommand& cmd : _draws)
+				{
+					const size_t first = std::max(start, cmd.firstVertex);
+					const size_t last = std::min(end, cmd.firstVertex + cmd.numVertices);
+
+					if (first < last)
+					{
+						shadeVertices(cmd,
+							(rnd::u32)(first - cmd.firstVertex), (rnd::u32)(last - cmd.firstVertex),
+							_vertexUsed.data() + cmd.firstVertex, _vertices.data() + cmd.firstVertex, _screen.data() + cmd.firstVertex);
+					}
+				}
+			});
+		}
 
-				const std::size_t sz = gv0.count;
-				for (int j = 0; j < sz; ++j)
+		_threadPool.waitAll();
+
+		// every triangle of a draw gets the same number of varying planes
+		size_t nPlanes = 0;
+		for (DrawCommand& cmd : _draws)
+		{
+			cmd.firstPlane = nPlanes;
+			cmd.planeStride = 0;
+
+			for (size_t v = 0; v < cmd.numVertices; ++v)
+			{
+				if (_vertexUsed[cmd.firstVertex + v])
 				{
-					gv0.vals[j] = gv0.vals[j] * vsout[0].Position.w;
-					gv1.vals[j] = gv1.vals[j] * vsout[1].Position.w;
-					gv2.vals[j] = gv2.vals[j] * vsout[2].Position.w;
+					cmd.planeStride = VaryingLayout<Vertex>::Of(_vertices[cmd.firstVertex + v]).NumFloats();
+					break;
 				}
 			}
+			nPlanes += cmd.numTriangles * cmd.planeStride;
+		}
 
-			rnd::f32 area = math::det_2d(
-				vsout[1].Position - vsout[0].Position,
-				vsout[2].Position - vsout[0].Position
-			);
+		if (_planes.size() < nPlanes)
+			_planes.resize(nPlanes);
 
-			bool culled = false;
+		// primitive assembly and binning
+		const size_t nTriangles = _drawTriangles;
+		if (triangles.size() < nTriangles)
+			triangles.resize(nTriangles);
 
-			// backface culling
-			const rnd::b8 ccw = area < 0.f;
-			if (!ccw)
-				culled = true;
+		const size_t triPerThread = (nTriangles + (nThreads - 1)) / nThreads;
 
-			std::swap(vsout[1], vsout[2]);
-			area = -area;
+		for (int i = 0; i < nThreads; ++i)
+		{
+			const size_t start = std::min(i * triPerThread, nTriangles);
+			const size_t end = std::min(start + triPerThread, nTriangles);
 
-			out[i] = Triangle{ vsout[0], vsout[1], vsout[2], area, culled };
+			_threadPool.enqueue([this, i, start, end] {
+				_bins[i].Reset(_grid.NumTiles());
+				_clipped[i].Clear();
 
+				// survivors are packed at the start of the thread's slice of triangles and planes
+				size_t next = start;
+				size_t nextPlane = planeSlot(start);
+
+				// the range can span several draws
+				for (rnd::u32 d = 0; d < _draws.size(); ++d)
+				{
+					const DrawCommand& cmd = _draws[d];
+					const size_t first = std::max(start, cmd.firstTriangle);
+					const size_t last = std::min(end, cmd.firstTriangle + cmd.numTriangles);
+
+					if (first < last)
+						assembleTriangles(cmd, d, first, last, next, nextPlane, _bins[i], _clipped[i]);
+				}
+			});
+		}
+
+		_threadPool.waitAll();
+
+		// rasterize tiles, most expensive first, pulled from a shared cursor
+		scheduleTiles();
+		_tileCursor.store(0, std::memory_order_relaxed);
+
+		// the G-buffer is filled from the visibility buffer, so deferred shading needs one too
+		const bool useVisibility = _visibilityEnabled || _gbuffer;
+
+		if (_gbuffer)
+			_gbuffer->Resize(_fb.get_width(), _fb.get_height());
+
+		// the deferred geometry pass writes the G-buffer, never the color buffer
+		const bool useColor = !_gbuffer;
+
+		for (TileBuffer& tile : _tileBuffers)
+			tile.Reserve(_grid.tileW, _grid.tileH);
+
+		for (int i = 0; i < nThreads; ++i)
+		{
+			_threadPool.enqueue([this, i, useVisibility, useColor] {
+				TileBuffer& tile = _tileBuffers[i];
+
+				while (true)
+				{
+					const size_t next = _tileCursor.fetch_add(1, std::memory_order_relaxed);
+					if (next >= _tileOrder.size())
+						break;
+
+					const rnd::i32 idx = _tileOrder[next].tile;
+
+					rnd::i32 tileStartX, tileStartY, tileEndX, tileEndY;
+					_grid.TileBounds(idx, tileStartX, tileStartY, tileEndX, tileEndY);
+
+					// the tile is rasterized in its tile buffer and written back once at the end;
+					// triangle ids only live until the tile is resolved
+					tile.Load(_fb, tileStartX, tileStartY, tileEndX, tileEndY, useColor, useVisibility);
+
+					// per-thread lists in thread order keep the submission order
+					for (size_t b = 0; b < nThreads; ++b)
+					{
+						const ClippedTriangles& clipped = _clipped[b];
+
+						_bins[b].ForEach(idx, [&](rnd::i32 ti) {
+							// negative indices are pieces of clipped triangles, kept by the thread that binned them
+							const Triangle<Vertex>& t = ti >= 0 ? triangles[ti] : clipped.triangles[~ti];
+							const AttributePlane* planes = (ti >= 0 ? _planes.data() : clipped.planes.data()) + t.firstPlane;
+
+							const DrawCommand& cmd = _draws[t.draw];
+
+							const rnd::u32 samples = TileRasterizerFunctor<ShaderProgram>()(
+								tileStartX, tileStartY,
+								tileEndX, tileEndY,
+								t,
+								planes,
+								cmd.program,
+								tile,
+								_fb.hiz_buffer.get(),
+								_fb.hiz_width,
+								visibilityId(b, ti)
+							);
+
+							addQuerySamples(cmd.query, samples);
+						});
+					}
+
+					if constexpr (DeferredFragmentShader<ShaderProgram>)
+					{
+						if (_gbuffer)
+						{
+							TileGBufferFunctor<ShaderProgram>()(
+								tileStartX, tileStartY,
+								tileEndX, tileEndY,
+								tile,
+								*_gbuffer,
+								_fb.get_width(),
+								[this](rnd::u32 id) { return resolveVisibility(id); }
+							);
+						}
+					}
+
+					if (useVisibility && useColor)
+					{
+						TileResolveFunctor<ShaderProgram>()(
+							tileStartX, tileStartY,
+							tileEndX, tileEndY,
+							tile,
+							[this](rnd::u32 id) { return resolveVisibility(id); }
+						);
+					}
+
+					tile.Store(_fb);
+				}
+			});
 		}
+		_threadPool.waitAll();
+
+		clearDraws();
 
-		setupTrianglesRange(startRange, endRange, out);
+		if (_tileTuner.IsActive())
+			_tileTuner.AddTime(std::chrono::duration<rnd::f64, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+	}
+
+	// First varying plane slot of frame triangle i, as laid out by the draws' plane strides.
+	size_t planeSlot(size_t i) const
+	{
+		for (const DrawCommand& cmd : _draws)
+		{
+			if (i < cmd.firstTriangle + cmd.numTriangles)
+				return cmd.firstPlane + (i - cmd.firstTriangle) * cmd.planeStride;
+		}
+
+		const DrawCommand& last = _draws.back();
+		return last.firstPlane + last.numTriangles * last.planeStride;
+	}
+
+	// Builds the triangles [startRange, endRange) of the frame, which all belong to cmd,
+	// from the shaded vertices, then culls, clips, sets up and bins them. Surviving triangles
+	// only keep their edges and attribute planes, the vertices are not copied. They are
+	// compacted: written to triangles[next] and their planes to _planes[nextPlane], both of
+	// which advance past each survivor, so culled triangles leave no hole and cost no write.
+	void assembleTriangles(const DrawCommand& cmd, rnd::u32 drawIdx, size_t startRange, size_t endRange, size_t& next, size_t& nextPlane, ThreadBins& bins, ClippedTriangles& clipped)
+	{
+		const Vertex* vertices = _vertices.data() + cmd.firstVertex;
+		const ScreenVertex* screen = _screen.data() + cmd.firstVertex;
+
+		// pieces of clipped triangles are binned as soon as they are made, so tiles keep the submission order
+		auto binClipped = [&](const Triangle<Vertex>& piece, const AttributePlane* planes) {
+			const rnd::i32 local = (rnd::i32)clipped.triangles.size();
+
+			Triangle<Vertex>& c = clipped.triangles.emplace_back(piece);
+			c.firstPlane = (rnd::u32)clipped.planes.size();
+			clipped.planes.insert(clipped.planes.end(), planes, planes + piece.layout.NumFloats());
+
+			binTriangle(c, ~local, bins);
+		};
+
+		for (size_t i = startRange; i < endRange; ++i)
+		{
+			const rnd::u16* indices = cmd.indexBuffer->data + (i - cmd.firstTriangle) * 3;
+
+			Triangle<Vertex>& t = triangles[next];
+			t.draw = drawIdx;
+			t.firstPlane = (rnd::u32)nextPlane;
+
+			if (!setupTriangle(cmd, vertices, screen, indices[0], indices[1], indices[2], t, _planes.data() + nextPlane, binClipped))
+				continue;
+
+			assert(t.layout.NumFloats() <= cmd.planeStride);
+			binTriangle(t, (rnd::i32)next, bins);
+
+			++next;
+			nextPlane += t.layout.NumFloats();
+		}
 	}
 
 	//void rasterizeTile(rnd::framebuffer& fb, int tileStartX, int tileStartY, int tileEndX, int tileEndY, std::vector<Triangle> triangles)
@@ -638,77 +1147,108 @@ private:
 	//	}
 	//}
 
-	void setupTrianglesRange(int start, int end, const Triangle* triangles)
+	// Visibility buffer id of a binned triangle: 0 means no triangle, frame triangles store
+	// their index + 1, and clipped pieces set the top bit with their assembly thread
+	// above their index in that thread's list. The draw is found through the triangle.
+	static constexpr rnd::u32 VISIBILITY_CLIPPED = 1u << 31;
+	static constexpr rnd::u32 VISIBILITY_THREAD_SHIFT = 28;
+	static constexpr rnd::u32 VISIBILITY_INDEX_MASK = (1u << VISIBILITY_THREAD_SHIFT) - 1;
+
+	static_assert(nThreads <= (VISIBILITY_CLIPPED >> VISIBILITY_THREAD_SHIFT), "assembly thread doesn't fit in a visibility id");
+
+	static rnd::u32 visibilityId(size_t thread, rnd::i32 index)
 	{
-		for (int ti = start; ti < end; ++ti)
+		if (index >= 0)
+			return (rnd::u32)index + 1;
+
+		assert((rnd::u32)~index <= VISIBILITY_INDEX_MASK);
+		return VISIBILITY_CLIPPED | ((rnd::u32)thread << VISIBILITY_THREAD_SHIFT) | (rnd::u32)~index;
+	}
+
+	VisibleTriangle<ShaderProgram> resolveVisibility(rnd::u32 id) const
+	{
+		const Triangle<Vertex>* t;
+		const AttributePlane* planes;
+
+		if (id & VISIBILITY_CLIPPED)
 		{
-			const Triangle& t = triangles[ti];
+			const ClippedTriangles& clipped = _clipped[(id & ~VISIBILITY_CLIPPED) >> VISIBILITY_THREAD_SHIFT];
+			t = &clipped.triangles[id & VISIBILITY_INDEX_MASK];
+			planes = clipped.planes.data() + t->firstPlane;
+		}
+		else
+		{
+			t = &triangles[id - 1];
+			planes = _planes.data() + t->firstPlane;
+		}
 
-			if (t.culled)
-				continue;
+		return { t, planes, _draws[t->draw].program };
+	}
 
-			// bbox
-			const int minX = std::floor(std::min({ t.v0.Position.x, t.v1.Position.x, t.v2.Position.x }));
-			const int maxX = std::ceil(std::max({ t.v0.Position.x, t.v1.Position.x, t.v2.Position.x }));
-			const int minY = std::floor(std::min({ t.v0.Position.y, t.v1.Position.y, t.v2.Position.y }));
-			const int maxY = std::ceil(std::max({ t.v0.Position.y, t.v1.Position.y, t.v2.Position.y }));
+	// Pushes a set up triangle into the bin of every tile its bounding box touches.
+	void binTriangle(const Triangle<Vertex>& t, rnd::i32 index, ThreadBins& bins) const
+	{
+		const TriangleSetup& setup = t.setup;
 
-			// tile bounds
-			const int tx0 = std::max(0, minX / TILE_W);
-			const int tx1 = std::min(NUM_TX - 1, maxX / TILE_W);
-			const int ty0 = std::max(0, minY / TILE_H);
-			const int ty1 = std::min(NUM_TY - 1, maxY / TILE_H);
+		// small triangles nearly always sit in a single tile, which skips the tile loops
+		if (t.small && setup.xmin >= 0 && setup.ymin >= 0)
+		{
+			const int tx = setup.xmin / _grid.tileW;
+			const int ty = setup.ymin / _grid.tileH;
 
-			for (int ty = ty0; ty <= ty1; ++ty)
+			if (tx == setup.xmax / _grid.tileW && ty == setup.ymax / _grid.tileH && tx < _grid.numTX && ty < _grid.numTY)
 			{
-				for (int tx = tx0; tx <= tx1; ++tx)
-				{
-					const int idx = ty * NUM_TX + tx;
+				bins.Push(ty * _grid.numTX + tx, index);
+				return;
+			}
+		}
 
-					//int c = binCount[idx]++;
-					const int c = binCount[idx].fetch_add(1, std::memory_order_relaxed);
+		// tile bounds
+		const int tx0 = std::max(0, setup.xmin / _grid.tileW);
+		const int tx1 = std::min(_grid.numTX - 1, setup.xmax / _grid.tileW);
+		const int ty0 = std::max(0, setup.ymin / _grid.tileH);
+		const int ty1 = std::min(_grid.numTY - 1, setup.ymax / _grid.tileH);
 
-					assert(c < MAX_TRI_PER_TILE);
-					binData[idx * MAX_TRI_PER_TILE + c] = ti;	// binData[idx][c] = ti;
-				}
-			}
+		for (int ty = ty0; ty <= ty1; ++ty)
+		{
+			for (int tx = tx0; tx <= tx1; ++tx)
+				bins.Push(ty * _grid.numTX + tx, index);
 		}
 	}
 
-	void setupTriangles(int nTriangles)
+	// Collects the non-empty tiles sorted by estimated raster cost (binned triangles times tile area),
+	// so the big tiles start first and the cheap ones fill the gaps at the end of the frame.
+	void scheduleTiles()
 	{
-		// bin each triangle by it's bounding box
-		for (int ti = 0; ti < nTriangles; ++ti)
+		_tileOrder.clear();
+
+		for (rnd::i32 idx = 0; idx < _grid.NumTiles(); ++idx)
 		{
-			Triangle& t = triangles[ti];
+			rnd::i64 count = 0;
+			for (const ThreadBins& bins : _bins)
+				count += bins.Count(idx);
 
-			if (t.culled)
+			if (count == 0)
 				continue;
 
-			// bbox
-			int minX = std::floor(std::min({ t.v0.Position.x, t.v1.Position.x, t.v2.Position.x }));
-			int maxX = std::ceil(std::max({ t.v0.Position.x, t.v1.Position.x, t.v2.Position.x }));
-			int minY = std::floor(std::min({ t.v0.Position.y, t.v1.Position.y, t.v2.Position.y }));
-			int maxY = std::ceil(std::max({ t.v0.Position.y, t.v1.Position.y, t.v2.Position.y }));
+			rnd::i32 x0, y0, x1, y1;
+			_grid.TileBounds(idx, x0, y0, x1, y1);
 
-			// tile bounds
-			int tx0 = std::max(0, minX / TILE_W);
-			int tx1 = std::min(NUM_TX - 1, maxX / TILE_W);
-			int ty0 = std::max(0, minY / TILE_H);
-			int ty1 = std::min(NUM_TY - 1, maxY / TILE_H);
+			_tileOrder.push_back({ count * (x1 - x0) * (y1 - y0), idx });
+		}
 
-			for (int ty = ty0; ty <= ty1; ++ty)
-			{
-				for (int tx = tx0; tx <= tx1; ++tx)
-				{
-					int idx = ty * NUM_TX + tx;
+		std::sort(_tileOrder.begin(), _tileOrder.end(), [](const TileJob& a, const TileJob& b) {
+			return a.cost != b.cost ? a.cost > b.cost : a.tile < b.tile;
+		});
+	}
 
-					int c = binCount[idx].fetch_add(1, std::memory_order_relaxed);
-					assert(c < MAX_TRI_PER_TILE);
-					binData[idx * MAX_TRI_PER_TILE + c] = ti;	// binData[idx][c] = ti;
-				}
-			}
-		}
+	static_assert(BinGrid::TILE_ALIGN == rnd::framebuffer::HIZ_BLOCK, "tiles must be made of whole hierarchical z blocks");
+
+	// Recomputes the tile layout when the framebuffer size or the tile size changed.
+	// The per-thread bins are resized at the start of every draw.
+	void UpdateBinGrid()
+	{
+		_grid.Resize((rnd::i32)_fb.get_width(), (rnd::i32)_fb.get_height(), _tileSize.x, _tileSize.y);
 	}
 private:
 	rnd::framebuffer& _fb;
@@ -723,19 +1263,56 @@ private:
 	viewport _viewport = { 0 };
 
 	// binning
-	static constexpr int W = 800;      
-	static constexpr int H = 600;      
-	static constexpr int TILE_W = 128;	// tile size
-	static constexpr int TILE_H = 64;
-	static constexpr int NUM_TX = (W + TILE_W - 1) / TILE_W;  // (800+63)/64 = 13
-	static constexpr int NUM_TY = (H + TILE_H - 1) / TILE_H;  // (600+63)/64 = 10
-	static constexpr int MAX_TRI_PER_TILE = 10000;
+	math::vec2i _tileSize = { BinGrid::DEFAULT_TILE_W, BinGrid::DEFAULT_TILE_H };
+	BinGrid _grid;
+	TileAutoTuner _tileTuner;
 	// std::vector<int> activeTiles;
 
-	//std::vector<Triangle> triangles;
-	Triangle* triangles = nullptr;
-	int* binData = nullptr;		// [NUM_TX * NUM_TY][MAX_TRI_PER_TILE]
-	//std::atomic<int>* binCount = nullptr;	// [NUM_TX * NUM_TY]
-	std::unique_ptr<std::atomic<int>[]> binCount;
+	// frame recording
+	bool _recording = false;
+	std::vector<DrawCommand> _draws;
+	std::deque<ShaderProgram> _programSnapshots;
+	size_t _drawTriangles = 0;
+
+	std::vector<rnd::u8> _vertexUsed;
+	std::vector<Vertex> _vertices;	// shaded vertices of the frame, in clip space
+	std::vector<ScreenVertex> _screen;	// their outcodes and screen space positions
+	std::vector<Triangle<Vertex>> triangles;	// grows to the largest frame seen
+	std::vector<AttributePlane> _planes;		// varying planes of the frame's triangles
+	std::array<ThreadBins, nThreads> _bins;
+	std::array<ClippedTriangles, nThreads> _clipped;	// triangles made by clipping, per assembly thread
+
+	// scratch of the immediate draws (DrawIndexed, Draw), grows to the largest draw seen
+	std::vector<rnd::u8> _immediateUsed;
+	std::vector<Vertex> _immediateVertices;
+	std::vector<ScreenVertex> _immediateScreen;
+
+	bool _visibilityEnabled = false;
+	std::array<TileBuffer, nThreads> _tileBuffers;	// tile-local color, depth and triangle ids, per raster worker
+
+	// deferred shading
+	GBuffer* _gbuffer = nullptr;
+	std::atomic<size_t> _lightTileCount = 0;
+
+	struct TileJob
+	{
+		rnd::i64 cost;
+		rnd::i32 tile;
+	};
+	std::vector<TileJob> _tileOrder;
+	std::atomic<size_t> _tileCursor = 0;
+
+	// occlusion culling
+	OcclusionBuffer _occlusion;
+	std::vector<rnd::u8> _occluderUsed;			// scratch of DrawOccluder, kept between calls
+	std::vector<math::vec4> _occluderPositions;
+	OcclusionStats _occlusionStats;
+	gfx::aabb _drawBounds;
+	math::mat4 _drawModelViewProj;
+	bool _hasDrawBounds = false;
+
+	// occlusion queries, a deque so the atomics never move
+	std::deque<OcclusionQuery> _queries;
+	rnd::i32 _activeQuery = -1;
 	ThreadPool _threadPool;
 };
\ No newline at end of file
@@ -20,6 +20,25 @@ struct point_light
 	rnd::f32 att_const;
 };
 
+// Distance past which the light's diffuse term stays under cutoff (in 0..1 color units),
+// solved from the attenuation. Deferred shading culls the light beyond it.
+inline rnd::f32 light_range(const point_light& l, rnd::f32 cutoff = 1.f / 256.f)
+{
+	const rnd::f32 brightest = std::max({ l.diffuse.x, l.diffuse.y, l.diffuse.z });
+
+	// att_quad * d^2 + att_linear * d + att_const = brightest / cutoff
+	const rnd::f32 c = l.att_const - brightest / cutoff;
+	if (c >= 0.f)
+		return 0.f;
+
+	if (l.att_quad > 0.f)
+		return (-l.att_linear + std::sqrt(l.att_linear * l.att_linear - 4.f * l.att_quad * c)) / (2.f * l.att_quad);
+	if (l.att_linear > 0.f)
+		return -c / l.att_linear;
+
+	return std::numeric_limits<rnd::f32>::max();
+}
+
 //cbuffer PointLightCBuf : register(b0)
 //{
 //	float3 viewLightPos;
@@ -4,6 +4,7 @@
 #include "types.hpp"
 #include <vector>
 #include "handle_manager.hpp"
+#include "bounds.hpp"
 #include "generic_renderer.hpp"
 
 namespace gfx
@@ -29,6 +30,10 @@ namespace gfx
 		std::vector<vertex> vertices;
 		std::vector<rnd::u16> indices;
 
+		// object space bounds, filled in at load
+		aabb bounds;
+		bounding_sphere sphere;
+
 		rnd::resource_handle vboid;
 		rnd::resource_handle iboid;
 	};
@@ -86,10 +86,50 @@ namespace gfx
 				}
 			}
 
-			return mesh(vertices, indices);
+			mesh result(std::move(vertices), std::move(indices));
+			compute_bounds(result);
+			return result;
+		}
+
+		/// <summary>
+		/// Tests every mesh against the frustum of model_view_proj (planes in object space, so the
+		/// bounds don't need transforming) and collects the ones that may be visible.
+		/// </summary>
+		void cull(const math::mat4& model_view_proj, std::vector<const mesh*>& visible, cull_stats& stats) const
+		{
+			const frustum f = frustum::from_matrix(model_view_proj);
+
+			visible.clear();
+			for (const mesh& m : meshes)
+			{
+				++stats.meshes_tested;
+
+				// the sphere rejects most meshes, the box catches the ones near the corners
+				if (!f.intersects(m.sphere) || !f.intersects(m.bounds))
+				{
+					++stats.meshes_culled;
+					stats.triangles_culled += m.indices.size() / 3;
+					continue;
+				}
+
+				visible.push_back(&m);
+			}
 		}
 
 	private:
+		static void compute_bounds(mesh& m)
+		{
+			for (const vertex& v : m.vertices)
+				m.bounds.expand(v.position);
+
+			if (m.bounds.empty())
+				return;
+
+			m.sphere.center = m.bounds.center();
+			for (const vertex& v : m.vertices)
+				m.sphere.radius = std::max(m.sphere.radius, math::length(v.position - m.sphere.center));
+		}
+
 		void center_model(const aiScene* scene)
 		{
 			aiVector3D centroid(0, 0, 0);
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+#include "types.hpp"
+#include "simd.h"
+#include "frame_buffer.hpp"
+#include "math/vector.hpp"
+#include "math/matrix.hpp"
+#include "triangle_setup.hpp"
+#include "bounds.hpp"
+
+// What occlusion culling skipped, reset every frame by Renderer::BeginFrame.
+struct OcclusionStats
+{
+	rnd::u32 drawsTested = 0;
+	rnd::u32 drawsCulled = 0;
+	rnd::u64 trianglesCulled = 0;
+};
+
+/// <summary>
+/// Low resolution, depth-only buffer for software occlusion culling. Designated occluders
+/// are rasterized into it with the same fixed point edges as the color pipeline, and every
+/// pixel the triangle covers entirely gets the triangle's farthest depth. Partly covered
+/// pixels are left alone, so a gap between occluders never closes at this resolution.
+/// Bounding boxes are then tested against it before their draws reach the vertex stage.
+/// Depth is w (view distance), like the color pipeline's depth buffer.
+/// </summary>
+struct OcclusionBuffer
+{
+	static constexpr rnd::i32 DEFAULT_WIDTH = 256;
+	static constexpr rnd::i32 DEFAULT_HEIGHT = 128;
+
+	// Occluder vertices further than this (in buffer pixels) from the buffer are dropped
+	// instead of clipped, which keeps the edge equations small.
+	static constexpr rnd::f32 GUARD_BAND = 2048.f;
+
+	OcclusionBuffer(rnd::i32 width = DEFAULT_WIDTH, rnd::i32 height = DEFAULT_HEIGHT)
+	{
+		Resize(width, height);
+	}
+
+	void Resize(rnd::i32 width, rnd::i32 height)
+	{
+		assert(width > 0 && width % simd::vFloat::Length == 0 && "width must be a multiple of the SIMD width");
+		assert(height > 0);
+
+		_width = width;
+		_height = height;
+		_depth = std::make_unique<rnd::f32[]>(width * height);
+		Clear();
+	}
+
+	void Clear()
+	{
+		std::fill(_depth.get(), _depth.get() + _width * _height, MAX_DEPTH);
+	}
+
+	inline rnd::i32 GetWidth() const { return _width; }
+	inline rnd::i32 GetHeight() const { return _height; }
+	inline const rnd::f32* GetDepth() const { return _depth.get(); }
+
+	/// <summary>
+	/// Rasterizes one occluder triangle given in clip space. Either winding is accepted.
+	/// Triangles crossing the near plane or leaving the guard band are skipped, which
+	/// only makes the buffer less occluding.
+	/// </summary>
+	void RasterizeTriangle(const math::vec4& c0, const math::vec4& c1, const math::vec4& c2)
+	{
+		using namespace simd;
+
+		if (c0.z < -c0.w || c1.z < -c1.w || c2.z < -c2.w)
+			return;
+
+		math::vec4 p[3] = { toBuffer(c0), toBuffer(c1), toBuffer(c2) };
+		for (const math::vec4& v : p)
+		{
+			if (std::abs(v.x) > GUARD_BAND || std::abs(v.y) > GUARD_BAND)
+				return;
+		}
+
+		// y points down, so counter clockwise on screen has a negative area
+		const rnd::f32 area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+		if (area < 0.f)
+			std::swap(p[1], p[2]);
+
+		TriangleSetup ts;
+		if (!SetupTriangle(p[0], p[1], p[2], ts))
+			return;
+
+		// the farthest point of the triangle, so the occluder never hides more than itself
+		const vFloat depth(std::max({ c0.w, c1.w, c2.w }));
+
+		// inner conservative coverage: moving the edges in by half a pixel in x and y means a
+		// pixel center passes only when the whole pixel is on the inside of the edge
+		EdgeFunction edges[3] = { ts.e12, ts.e20, ts.e01 };
+		for (EdgeFunction& e : edges)
+			e.C -= (std::abs(e.A) + std::abs(e.B)) / 2;
+
+		const rnd::i32 xmin = std::max(ts.xmin, 0);
+		const rnd::i32 xmax = std::min(ts.xmax, _width - 1);
+		const rnd::i32 ymin = std::max(ts.ymin, 0);
+		const rnd::i32 ymax = std::min(ts.ymax, _height - 1);
+
+		if (xmin > xmax || ymin > ymax)
+			return;
+
+		const vInt ramp = vInt::ramp();
+		const vInt e0_lanes = ramp * vInt((rnd::i32)edges[0].A);
+		const vInt e1_lanes = ramp * vInt((rnd::i32)edges[1].A);
+		const vInt e2_lanes = ramp * vInt((rnd::i32)edges[2].A);
+
+		const rnd::i32 bxstart = xmin & ~(vFloat::Length - 1);
+
+		for (rnd::i32 y = ymin; y <= ymax; ++y)
+		{
+			rnd::f32* row = _depth.get() + y * _width;
+
+			for (rnd::i32 bx = bxstart; bx <= xmax; bx += vFloat::Length)
+			{
+				const vInt e0 = vInt(ClampEdge(edges[0].Evaluate(bx, y))) + e0_lanes;
+				const vInt e1 = vInt(ClampEdge(edges[1].Evaluate(bx, y))) + e1_lanes;
+				const vInt e2 = vInt(ClampEdge(edges[2].Evaluate(bx, y))) + e2_lanes;
+
+				const vInt covered = andnot((e0 | e1 | e2) >> 31, vInt(-1));
+				if (movemask(covered) == 0)
+					continue;
+
+				const vFloat d = vFloat::load(row + bx);
+				blend(d, min(d, depth), as_float(covered)).store(row + bx);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Returns false when the box, transformed by model_view_proj, is entirely behind the
+	/// occluders over its screen rectangle. Boxes crossing the near plane are always visible.
+	/// </summary>
+	bool IsVisible(const gfx::aabb& box, const math::mat4& model_view_proj) const
+	{
+		using namespace simd;
+
+		if (box.empty())
+			return false;
+
+		rnd::f32 xmin = std::numeric_limits<rnd::f32>::max(), ymin = xmin, nearest = xmin;
+		rnd::f32 xmax = -xmin, ymax = -xmin;
+
+		for (int i = 0; i < 8; ++i)
+		{
+			const math::vec3 corner = {
+				(i & 1) ? box.max.x : box.min.x,
+				(i & 2) ? box.max.y : box.min.y,
+				(i & 4) ? box.max.z : box.min.z
+			};
+			const math::vec4 c = model_view_proj * math::vec4{ corner, 1.f };
+
+			if (c.z < -c.w)
+				return true;
+
+			const math::vec4 p = toBuffer(c);
+			xmin = std::min(xmin, p.x);
+			xmax = std::max(xmax, p.x);
+			ymin = std::min(ymin, p.y);
+			ymax = std::max(ymax, p.y);
+			nearest = std::min(nearest, c.w);
+		}
+
+		// every pixel the rectangle touches; occluders only mark pixels they cover entirely
+		const rnd::i32 x0 = std::max((rnd::i32)std::floor(xmin), 0);
+		const rnd::i32 x1 = std::min((rnd::i32)std::floor(xmax), _width - 1);
+		const rnd::i32 y0 = std::max((rnd::i32)std::floor(ymin), 0);
+		const rnd::i32 y1 = std::min((rnd::i32)std::floor(ymax), _height - 1);
+
+		// off screen, that is for frustum culling to decide
+		if (x0 > x1 || y0 > y1)
+			return true;
+
+		const vInt ramp = vInt::ramp();
+		const vFloat near_depth(nearest);
+
+		for (rnd::i32 y = y0; y <= y1; ++y)
+		{
+			const rnd::f32* row = _depth.get() + y * _width;
+
+			for (rnd::i32 bx = x0 & ~(vFloat::Length - 1); bx <= x1; bx += vFloat::Length)
+			{
+				const vInt xs = vInt(bx) + ramp;
+				const vInt in_rect = mask_gt(xs, vInt(x0 - 1)) & mask_lt(xs, vInt(x1 + 1));
+
+				// visible as soon as one pixel's occluders are not in front of the box
+				const vInt open = as_int(vFloat::load(row + bx) >= near_depth) & in_rect;
+				if (movemask(open) != 0)
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+private:
+	// clip space to buffer pixels, w keeps 1/w like the viewport transform
+	inline math::vec4 toBuffer(const math::vec4& c) const
+	{
+		const rnd::f32 rcp_w = 1.f / c.w;
+		return {
+			(0.5f + 0.5f * c.x * rcp_w) * _width,
+			(0.5f - 0.5f * c.y * rcp_w) * _height,
+			c.z * rcp_w,
+			rcp_w
+		};
+	}
+
+	rnd::i32 _width = 0, _height = 0;
+	std::unique_ptr<rnd::f32[]> _depth;
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+#include "types.hpp"
+#include "frame_buffer.hpp"
+
+/// <summary>
+/// Tile-local working set of a raster worker. The color, depth and visibility ids of the
+/// tile being rasterized live in one contiguous block, with rows a whole number of cache
+/// lines long, instead of being spread over rows of the full framebuffer. The block is
+/// filled from the framebuffer by Load and written back once by Store when the tile is done.
+/// Blocks of a fast cleared framebuffer are not read: Load fills them with the clear value.
+/// Kernels keep using screen coordinates and address the block through Index.
+/// </summary>
+struct TileBuffer
+{
+	static constexpr rnd::i32 CACHE_LINE = 64;
+
+	// pixels per cache line; every pixel of every plane is 4 bytes
+	static constexpr rnd::i32 LINE_PIXELS = CACHE_LINE / 4;
+
+	/// <summary>
+	/// Makes room for tiles up to tileW x tileH. Keeps the current block when it is big enough.
+	/// </summary>
+	void Reserve(rnd::i32 tileW, rnd::i32 tileH)
+	{
+		assert(tileW > 0 && tileH > 0);
+
+		const rnd::i32 tileStride = (tileW + LINE_PIXELS - 1) & ~(LINE_PIXELS - 1);
+		const size_t lines = (size_t)(tileStride / LINE_PIXELS) * tileH;
+
+		if (tileStride == stride && lines <= _planeLines)
+			return;
+
+		stride = tileStride;
+		_planeLines = lines;
+
+		// three planes back to back: color, depth, visibility
+		_storage = std::make_unique<CacheLine[]>(lines * 3);
+
+		color = reinterpret_cast<rnd::color*>(_storage.get());
+		depth = reinterpret_cast<rnd::f32*>(_storage.get() + lines);
+		_visibility = reinterpret_cast<rnd::u32*>(_storage.get() + lines * 2);
+	}
+
+	/// <summary>
+	/// Starts the tile [x0, x1) x [y0, y1): copies its depth, and its color when load_color is
+	/// set, in from the framebuffer, or the clear value for the blocks still pending a clear.
+	/// With use_visibility the ids are cleared and visibility points at them, otherwise
+	/// visibility is null. Tiles are made of whole HIZ_BLOCK blocks, clipped to the framebuffer.
+	/// </summary>
+	void Load(const rnd::framebuffer& fb, rnd::i32 x0, rnd::i32 y0, rnd::i32 x1, rnd::i32 y1, bool load_color, bool use_visibility)
+	{
+		assert(x1 - x0 <= stride && (size_t)(y1 - y0) * (stride / LINE_PIXELS) <= _planeLines && "tile larger than reserved");
+
+		_x0 = x0;
+		_y0 = y0;
+		_x1 = x1;
+		_y1 = y1;
+		_hasColor = load_color;
+
+		constexpr rnd::i32 BLOCK = rnd::framebuffer::HIZ_BLOCK;
+		assert(x0 % BLOCK == 0 && y0 % BLOCK == 0);
+
+		const rnd::i32 width = x1 - x0;
+
+		for (rnd::i32 y = y0; y < y1; ++y)
+		{
+			const rnd::u8* pending = fb.pending_clear.get() + (y / BLOCK) * fb.hiz_width;
+
+			// a block row is contiguous in either framebuffer layout
+			for (rnd::i32 x = x0; x < x1; x += BLOCK)
+			{
+				const size_t src = fb.pixel_index(x, y);
+				const size_t dst = Index(x, y);
+				const rnd::i32 n = std::min(BLOCK, x1 - x);
+				const rnd::u8 cleared = pending[x / BLOCK];
+
+				if (cleared & rnd::framebuffer::CLEAR_DEPTH)
+					std::fill_n(depth + dst, n, fb.clear_depth_value);
+				else
+					std::copy_n(fb.depth_buffer.get() + src, n, depth + dst);
+
+				if (!load_color)
+					continue;
+
+				if (cleared & rnd::framebuffer::CLEAR_COLOR)
+					std::fill_n(color + dst, n, fb.clear_color_value);
+				else
+					std::copy_n(fb.color_buffer.get() + src, n, color + dst);
+			}
+
+			if (use_visibility)
+				std::fill_n(_visibility + Index(x0, y), width, 0u);
+		}
+
+		visibility = use_visibility ? _visibility : nullptr;
+	}
+
+	/// <summary>
+	/// Writes the tile back to the framebuffer: depth always, color when it was loaded.
+	/// The blocks written are no longer pending a clear.
+	/// </summary>
+	void Store(rnd::framebuffer& fb) const
+	{
+		constexpr rnd::i32 BLOCK = rnd::framebuffer::HIZ_BLOCK;
+
+		for (rnd::i32 y = _y0; y < _y1; ++y)
+		{
+			for (rnd::i32 x = _x0; x < _x1; x += BLOCK)
+			{
+				const size_t dst = fb.pixel_index(x, y);
+				const size_t src = Index(x, y);
+				const rnd::i32 n = std::min(BLOCK, _x1 - x);
+
+				std::copy_n(depth + src, n, fb.depth_buffer.get() + dst);
+				if (_hasColor)
+					std::copy_n(color + src, n, fb.color_buffer.get() + dst);
+			}
+		}
+
+		const rnd::u8 written = _hasColor ? (rnd::framebuffer::CLEAR_COLOR | rnd::framebuffer::CLEAR_DEPTH) : rnd::framebuffer::CLEAR_DEPTH;
+
+		for (rnd::i32 by = _y0 / BLOCK; by < (_y1 + BLOCK - 1) / BLOCK; ++by)
+		{
+			for (rnd::i32 bx = _x0 / BLOCK; bx < (_x1 + BLOCK - 1) / BLOCK; ++bx)
+				fb.pending_clear[by * fb.hiz_width + bx] &= ~written;
+		}
+	}
+
+	// Offset of screen pixel (x, y), which must lie inside the current tile.
+	inline size_t Index(rnd::i32 x, rnd::i32 y) const
+	{
+		return (size_t)(y - _y0) * stride + (x - _x0);
+	}
+
+	rnd::color* color = nullptr;
+	rnd::f32* depth = nullptr;
+	rnd::u32* visibility = nullptr;	// null unless the tile records triangle ids
+	rnd::i32 stride = 0;			// pixels per row, a multiple of LINE_PIXELS
+
+private:
+	struct alignas(CACHE_LINE) CacheLine
+	{
+		std::byte bytes[CACHE_LINE];
+	};
+
+	std::unique_ptr<CacheLine[]> _storage;
+	rnd::u32* _visibility = nullptr;
+	size_t _planeLines = 0;
+
+	rnd::i32 _x0 = 0, _y0 = 0, _x1 = 0, _y1 = 0;
+	bool _hasColor = true;
+};
@@ -0,0 +1,586 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+
+#include "types.hpp"
+#include "simd.h"
+#include "frame_buffer.hpp"
+#include "varying.hpp"
+#include "varying_batch.hpp"
+#include "triangle_setup.hpp"
+#include "tile_buffer.hpp"
+
+// Selects the 8-wide AVX2 tile kernel. Set to 0 to fall back to the scalar loop.
+#ifndef RND_RASTER_AVX2
+#define RND_RASTER_AVX2 1
+#endif
+
+/// <summary>
+/// Compact per triangle record produced by setup. The tiles only read the edges,
+/// the bounding box and the attribute planes; the vertices themselves are not kept.
+/// The varying planes live in a separate per-frame array starting at firstPlane.
+/// </summary>
+template <typename Vertex>
+struct Triangle
+{
+	TriangleSetup setup;
+
+	// x/w, y/w, z/w and 1/w; the last one doubles as the depth plane
+	AttributePlane position[4];
+
+	// lower bound of the depth (w) anywhere on the triangle, for hierarchical z
+	rnd::f32 nearestDepth = 0.f;
+
+	VaryingLayout<Vertex> layout;
+	rnd::u32 firstPlane = 0;
+
+	// index of the recorded draw the triangle came from
+	rnd::u32 draw = 0;
+	bool small = false;	// IsSmallTriangle, cached for binning and the tile kernel
+};
+
+// Depth at a given 1/w, pulled slightly towards the viewer so that rounding in the
+// per-pixel plane evaluation can never make a pixel nearer than the bound.
+static inline rnd::f32 ConservativeDepth(rnd::f32 rcp_w)
+{
+	return 0.9999f / rcp_w;
+}
+
+// Builds the position and varying planes of a set up triangle. p0..p2 are the screen
+// space positions (1/w in w) and f0..f2 the varyings as the vertex shader wrote them;
+// the perspective correction (varying * 1/w) happens here.
+template <typename Vertex>
+static inline void SetupPlanes(Triangle<Vertex>& t, const math::vec4& p0, const math::vec4& p1, const math::vec4& p2, const rnd::f32* f0, const rnd::f32* f1, const rnd::f32* f2, AttributePlane* varyings)
+{
+	const BarycentricPlanes bp = MakeBarycentricPlanes(t.setup);
+
+	t.position[0] = bp.Make(p0.x, p1.x, p2.x);
+	t.position[1] = bp.Make(p0.y, p1.y, p2.y);
+	t.position[2] = bp.Make(p0.z, p1.z, p2.z);
+	t.position[3] = bp.Make(p0.w, p1.w, p2.w);
+
+	t.nearestDepth = ConservativeDepth(std::max({ p0.w, p1.w, p2.w }));
+
+	for (std::size_t k = 0; k < t.layout.NumFloats(); ++k)
+		varyings[k] = bp.Make(f0[k] * p0.w, f1[k] * p1.w, f2[k] * p2.w);
+}
+
+// Evaluates the planes at (fx, fy), relative to the first bounding box pixel, and undoes the
+// perspective correction. z is 1 / (1/w plane) at the same pixel.
+template <typename Vertex>
+static inline Vertex InterpolatePlanes(const Triangle<Vertex>& t, const AttributePlane* varyings, rnd::f32 fx, rnd::f32 fy, rnd::f32 z)
+{
+	Vertex interpolated;
+	interpolated.Position = {
+		t.position[0].At(fx, fy) * z,
+		t.position[1].At(fx, fy) * z,
+		t.position[2].At(fx, fy) * z,
+		t.position[3].At(fx, fy) * z
+	};
+
+	rnd::f32 f[MaxVaryingFloats<Vertex>];
+	for (std::size_t k = 0; k < t.layout.NumFloats(); ++k)
+		f[k] = varyings[k].At(fx, fy) * z;
+
+	t.layout.Scatter(f, interpolated);
+	return interpolated;
+}
+
+// What a visibility buffer id resolves to when its pixel gets shaded.
+template <typename ShaderProgram>
+struct VisibleTriangle
+{
+	const Triangle<ShaderVertex<ShaderProgram>>* triangle;
+	const AttributePlane* planes;
+	const ShaderProgram* program;
+};
+
+#if !RND_RASTER_AVX2
+
+// Runs the full per-pixel pipeline (coverage, depth test/write, varying interpolation
+// and the fragment shader) for one triangle, restricted to a single tile.
+// Tiles never overlap, so every worker only touches its own region of the buffers.
+// The triangle is walked in hierarchical z blocks: blocks whose max depth is already in
+// front of the triangle are skipped, and blocks it covers entirely get their max refreshed.
+// Color and depth go to the tile's TileBuffer. When it records visibility, pixels passing
+// the depth test only store visibility_id and are shaded later by TileResolveFunctor.
+// Returns the number of samples that passed the depth test, for occlusion queries.
+template <typename ShaderProgram>
+struct TileRasterizerFunctor
+{
+	using Vertex = ShaderVertex<ShaderProgram>;
+
+	rnd::u32 operator()(int tileStartX, int tileStartY, int tileEndX, int tileEndY, const Triangle<Vertex>& t, const AttributePlane* planes, const ShaderProgram* program, TileBuffer& tile, rnd::f32* hiz_buffer, rnd::u32 hiz_width, rnd::u32 visibility_id = 0)
+	{
+		constexpr rnd::i32 BLOCK = rnd::framebuffer::HIZ_BLOCK;
+
+		const TriangleSetup& ts = t.setup;
+
+		// Clamp the snapped bounding box to the tile bounds.
+		const rnd::i32 xmin = std::max(ts.xmin, tileStartX);
+		const rnd::i32 xmax = std::min(ts.xmax, tileEndX - 1);
+		const rnd::i32 ymin = std::max(ts.ymin, tileStartY);
+		const rnd::i32 ymax = std::min(ts.ymax, tileEndY - 1);
+
+		rnd::u32 samples = 0;
+
+		for (rnd::i32 by = ymin & ~(BLOCK - 1); by <= ymax; by += BLOCK)
+		{
+			const rnd::i32 y0 = std::max(by, ymin);
+			const rnd::i32 y1 = std::min(by + BLOCK - 1, ymax);
+
+			for (rnd::i32 bx = xmin & ~(BLOCK - 1); bx <= xmax; bx += BLOCK)
+			{
+				// hierarchical z: the triangle is behind everything already drawn in this block
+				rnd::f32& block_max_depth = hiz_buffer[(by / BLOCK) * hiz_width + bx / BLOCK];
+				if (t.nearestDepth >= block_max_depth)
+					continue;
+
+				const rnd::i32 x0 = std::max(bx, xmin);
+				const rnd::i32 x1 = std::min(bx + BLOCK - 1, xmax);
+
+				rnd::i64 w0_row = ts.e12.Evaluate(x0, y0);
+				rnd::i64 w1_row = ts.e20.Evaluate(x0, y0);
+				rnd::i64 w2_row = ts.e01.Evaluate(x0, y0);
+
+				rnd::i32 covered = 0;
+
+				for (rnd::i32 y = y0; y <= y1; ++y)
+				{
+					rnd::i64 w0 = w0_row;
+					rnd::i64 w1 = w1_row;
+					rnd::i64 w2 = w2_row;
+
+					const rnd::f32 fy = (rnd::f32)(y - ts.ymin);
+
+					for (rnd::i32 x = x0; x <= x1; ++x, w0 += ts.e12.A, w1 += ts.e20.A, w2 += ts.e01.A)
+					{
+						if ((w0 | w1 | w2) < 0)
+							continue;
+
+						++covered;
+
+						const rnd::f32 fx = (rnd::f32)(x - ts.xmin);
+						const rnd::f32 z = 1.f / t.position[3].At(fx, fy);
+
+						const size_t index = tile.Index(x, y);
+
+						rnd::f32& depth = tile.depth[index];
+						if (z >= depth)
+							continue;
+						depth = z;
+						++samples;
+
+						if (tile.visibility)
+						{
+							tile.visibility[index] = visibility_id;
+							continue;
+						}
+
+						const Vertex interpolated = InterpolatePlanes(t, planes, fx, fy, z);
+						const math::vec4 color = program->fs(interpolated);
+
+						tile.color[index] = rnd::to_color(color);
+					}
+
+					w0_row += ts.e12.B;
+					w1_row += ts.e20.B;
+					w2_row += ts.e01.B;
+				}
+
+				// every pixel of the block was tested, so its max depth can be refreshed
+				if (covered == BLOCK * BLOCK)
+				{
+					rnd::f32 block_max = 0.f;
+					for (rnd::i32 y = by; y < by + BLOCK; ++y)
+					{
+						const rnd::f32* depth_row = tile.depth + tile.Index(bx, y);
+						block_max = std::max(block_max, *std::max_element(depth_row, depth_row + BLOCK));
+					}
+					block_max_depth = block_max;
+				}
+			}
+		}
+
+		return samples;
+	}
+};
+
+// Second pass of visibility buffer rendering: shades every pixel of the tile that has
+// a triangle id, once, with the winner of the depth test. resolve maps an id to its
+// VisibleTriangle. Interpolation matches TileRasterizerFunctor exactly.
+template <typename ShaderProgram>
+struct TileResolveFunctor
+{
+	using Vertex = ShaderVertex<ShaderProgram>;
+
+	template <typename Resolve>
+	void operator()(int tileStartX, int tileStartY, int tileEndX, int tileEndY, TileBuffer& tile, Resolve&& resolve)
+	{
+		for (int y = tileStartY; y < tileEndY; ++y)
+		{
+			for (int x = tileStartX; x < tileEndX; ++x)
+			{
+				const size_t index = tile.Index(x, y);
+
+				const rnd::u32 id = tile.visibility[index];
+				if (id == 0)
+					continue;
+
+				const VisibleTriangle<ShaderProgram> v = resolve(id);
+				const Triangle<Vertex>& t = *v.triangle;
+
+				const rnd::f32 fx = (rnd::f32)(x - t.setup.xmin);
+				const rnd::f32 fy = (rnd::f32)(y - t.setup.ymin);
+				const rnd::f32 z = 1.f / t.position[3].At(fx, fy);
+
+				const Vertex interpolated = InterpolatePlanes(t, v.planes, fx, fy, z);
+				tile.color[index] = rnd::to_color(v.program->fs(interpolated));
+			}
+		}
+	}
+};
+
+#else
+
+// Tiles are walked in 8x8 pixel blocks. Every block is first classified against the
+// three edges using its corner pixels: blocks outside any edge are skipped, blocks
+// inside all edges are shaded without a coverage test, and only blocks straddling
+// an edge compute a per-lane coverage mask.
+static constexpr rnd::i32 RASTER_BLOCK_SIZE = 8;
+
+static_assert(RASTER_BLOCK_SIZE == rnd::framebuffer::HIZ_BLOCK, "raster blocks and hierarchical z blocks must match");
+
+// Smallest and largest offset from E at a block's top-left pixel to E at any pixel of the block.
+static inline void EdgeBlockRange(const EdgeFunction& e, rnd::i64& lo, rnd::i64& hi)
+{
+	const rnd::i64 dx = (RASTER_BLOCK_SIZE - 1) * e.A;
+	const rnd::i64 dy = (RASTER_BLOCK_SIZE - 1) * e.B;
+
+	lo = std::min<rnd::i64>(dx, 0) + std::min<rnd::i64>(dy, 0);
+	hi = std::max<rnd::i64>(dx, 0) + std::max<rnd::i64>(dy, 0);
+}
+
+// Converts eight colors to packed rnd::color, rounding like rnd::to_color.
+static inline simd::vInt PackColors(const simd::vFloat4& c)
+{
+	using namespace simd;
+
+	const vFloat lo(0.f), hi(255.f);
+	const vInt r = trunc2i(min(max(c.x * hi, lo), hi));
+	const vInt g = trunc2i(min(max(c.y * hi, lo), hi));
+	const vInt b = trunc2i(min(max(c.z * hi, lo), hi));
+	const vInt a = trunc2i(min(max(c.w * hi, lo), hi));
+
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+// Plane value for the eight pixels of a span, same operation order as AttributePlane::At.
+static inline simd::vFloat EvalSpan(const AttributePlane& p, rnd::f32 fy, const simd::vFloat& fx)
+{
+	return simd::vFloat(p.c + p.dy * fy) + simd::vFloat(p.dx) * fx;
+}
+
+// Interpolates the varyings of a span of eight pixels and runs the fragment shader on the
+// lanes in mask, writing their colors to color_ptr. fx and fy are relative to the triangle's
+// first bounding box pixel, z is 1 / one_over_z. The shader runs once for the span when
+// the program has a batched overload, otherwise once per lane.
+template <typename ShaderProgram>
+static inline void ShadeSpan(const Triangle<ShaderVertex<ShaderProgram>>& t, const AttributePlane* planes, const ShaderProgram* program, rnd::f32 fy, const simd::vFloat& fx, const simd::vFloat& one_over_z, const simd::vFloat& z, const simd::vInt& mask, rnd::color* color_ptr)
+{
+	using namespace simd;
+	using Vertex = ShaderVertex<ShaderProgram>;
+
+	if constexpr (BatchedFragmentShader<ShaderProgram> && std::is_same_v<Vertex, VSOutput>)
+	{
+		VSOutputBatch interpolated;
+		interpolated.Position = {
+			EvalSpan(t.position[0], fy, fx) * z,
+			EvalSpan(t.position[1], fy, fx) * z,
+			EvalSpan(t.position[2], fy, fx) * z,
+			one_over_z * z
+		};
+		interpolated.used = t.layout.used;
+
+		const AttributePlane* plane = planes;
+		for (std::size_t j = 0; j < t.layout.used; ++j)
+		{
+			interpolated.counts[j] = t.layout.counts[j];
+			for (std::size_t k = 0; k < t.layout.counts[j]; ++k)
+				interpolated.varyings[j][k] = EvalSpan(*plane++, fy, fx) * z;
+		}
+
+		PackColors(program->fs(interpolated, mask)).store_masked(color_ptr, mask);
+	}
+	else
+	{
+		const std::size_t num_floats = t.layout.NumFloats();
+
+		alignas(32) rnd::f32 position_lanes[4][vFloat::Length];
+		alignas(32) rnd::f32 varying_lanes[MaxVaryingFloats<Vertex>][vFloat::Length];
+		alignas(32) rnd::color colors[vFloat::Length];
+
+		(EvalSpan(t.position[0], fy, fx) * z).store(position_lanes[0]);
+		(EvalSpan(t.position[1], fy, fx) * z).store(position_lanes[1]);
+		(EvalSpan(t.position[2], fy, fx) * z).store(position_lanes[2]);
+		(one_over_z * z).store(position_lanes[3]);
+
+		for (std::size_t k = 0; k < num_floats; ++k)
+			(EvalSpan(planes[k], fy, fx) * z).store(varying_lanes[k]);
+
+		// shade the surviving lanes
+		int bits = movemask(mask);
+		while (bits)
+		{
+			const int lane = std::countr_zero((unsigned)bits);
+			bits &= bits - 1;
+
+			Vertex interpolated;
+			interpolated.Position = { position_lanes[0][lane], position_lanes[1][lane], position_lanes[2][lane], position_lanes[3][lane] };
+
+			rnd::f32 f[MaxVaryingFloats<Vertex>];
+			for (std::size_t k = 0; k < num_floats; ++k)
+				f[k] = varying_lanes[k][lane];
+			t.layout.Scatter(f, interpolated);
+
+			colors[lane] = rnd::to_color(program->fs(interpolated));
+		}
+
+		vInt::load(colors).store_masked(color_ptr, mask);
+	}
+}
+
+// Same pipeline as the scalar version, but each row of a block (eight pixels) is
+// tested, depth tested and interpolated at once. Covered lanes are written back
+// with masked stores, and shaded by ShadeSpan.
+template <typename ShaderProgram>
+struct TileRasterizerFunctor
+{
+	using Vertex = ShaderVertex<ShaderProgram>;
+
+	rnd::u32 operator()(int tileStartX, int tileStartY, int tileEndX, int tileEndY, const Triangle<Vertex>& t, const AttributePlane* planes, const ShaderProgram* program, TileBuffer& tile, rnd::f32* hiz_buffer, rnd::u32 hiz_width, rnd::u32 visibility_id = 0)
+	{
+		using namespace simd;
+
+		const TriangleSetup& ts = t.setup;
+
+		// Clamp the snapped bounding box to the tile bounds.
+		const rnd::i32 xmin = std::max(ts.xmin, tileStartX);
+		const rnd::i32 xmax = std::min(ts.xmax, tileEndX - 1);
+		const rnd::i32 ymin = std::max(ts.ymin, tileStartY);
+		const rnd::i32 ymax = std::min(ts.ymax, tileEndY - 1);
+
+		if (xmin > xmax || ymin > ymax)
+			return 0;
+
+		const vInt ramp = vInt::ramp();
+
+		const vInt e0_lanes = ramp * vInt((rnd::i32)ts.e12.A);
+		const vInt e1_lanes = ramp * vInt((rnd::i32)ts.e20.A);
+		const vInt e2_lanes = ramp * vInt((rnd::i32)ts.e01.A);
+
+		// Depth test of the eight pixels starting at (x, y), then shading (or recording the
+		// visibility id) of the lanes that pass. mask selects the covered lanes.
+		// Returns how many lanes passed the depth test.
+		auto shade_span = [&](rnd::i32 x, rnd::i32 y, vInt mask) -> rnd::u32
+		{
+			const rnd::f32 fy = (rnd::f32)(y - ts.ymin);
+			const vFloat fx = conv2f(vInt(x - ts.xmin) + ramp);
+
+			const vFloat one_over_z = EvalSpan(t.position[3], fy, fx);
+			const vFloat z = vFloat(1.f) / one_over_z;
+
+			const size_t index = tile.Index(x, y);
+
+			rnd::f32* depth_ptr = tile.depth + index;
+			const vFloat depth = vFloat::load_masked(depth_ptr, mask);
+
+			mask = mask & as_int(z < depth);
+
+			const int bits = movemask(mask);
+			if (bits == 0)
+				return 0;
+
+			const rnd::u32 passed = (rnd::u32)std::popcount((unsigned)bits);
+
+			z.store_masked(depth_ptr, mask);
+
+			if (tile.visibility)
+				vInt((rnd::i32)visibility_id).store_masked(tile.visibility + index, mask);
+			else
+				ShadeSpan(t, planes, program, fy, fx, one_over_z, z, mask, tile.color + index);
+
+			return passed;
+		};
+
+		// Small triangles skip the block walk: one span per row, starting at the bounding box.
+		// The box is at most SMALL_TRIANGLE_SIZE wide, so the span covers it whole.
+		if (t.small)
+		{
+			static_assert(SMALL_TRIANGLE_SIZE <= vFloat::Length, "a small triangle's row must fit a span");
+
+			// same hierarchical z test as a block, when the triangle stays in one
+			if (xmin / RASTER_BLOCK_SIZE == xmax / RASTER_BLOCK_SIZE && ymin / RASTER_BLOCK_SIZE == ymax / RASTER_BLOCK_SIZE)
+			{
+				if (t.nearestDepth >= hiz_buffer[(ymin / RASTER_BLOCK_SIZE) * hiz_width + xmin / RASTER_BLOCK_SIZE])
+					return 0;
+			}
+
+			const vInt in_tile = mask_lt(vInt(xmin) + ramp, vInt(tileEndX));
+
+			rnd::u32 samples = 0;
+			for (rnd::i32 y = ymin; y <= ymax; ++y)
+			{
+				const vInt e0 = vInt(ClampEdge(ts.e12.Evaluate(xmin, y))) + e0_lanes;
+				const vInt e1 = vInt(ClampEdge(ts.e20.Evaluate(xmin, y))) + e1_lanes;
+				const vInt e2 = vInt(ClampEdge(ts.e01.Evaluate(xmin, y))) + e2_lanes;
+
+				const vInt mask = andnot((e0 | e1 | e2) >> 31, in_tile);
+				if (movemask(mask) != 0)
+					samples += shade_span(xmin, y, mask);
+			}
+			return samples;
+		}
+
+		// 1/w is linear in screen space, so its largest value over a block is at one of the
+		// block's corners. That gives the nearest depth the triangle can have in the block.
+		auto block_nearest_depth = [&](rnd::i32 bx, rnd::i32 by) {
+			const AttributePlane& p = t.position[3];
+			const rnd::f32 fx0 = (rnd::f32)(bx - ts.xmin), fx1 = fx0 + (RASTER_BLOCK_SIZE - 1);
+			const rnd::f32 fy0 = (rnd::f32)(by - ts.ymin), fy1 = fy0 + (RASTER_BLOCK_SIZE - 1);
+
+			const rnd::f32 rcp_w = std::max({ p.At(fx0, fy0), p.At(fx1, fy0), p.At(fx0, fy1), p.At(fx1, fy1) });
+			return rcp_w > 0.f ? std::max(t.nearestDepth, ConservativeDepth(rcp_w)) : t.nearestDepth;
+		};
+
+		rnd::i64 e0_lo, e0_hi, e1_lo, e1_hi, e2_lo, e2_hi;
+		EdgeBlockRange(ts.e12, e0_lo, e0_hi);
+		EdgeBlockRange(ts.e20, e1_lo, e1_hi);
+		EdgeBlockRange(ts.e01, e2_lo, e2_hi);
+
+		// blocks are aligned to the 8x8 screen grid
+		const rnd::i32 bxstart = xmin & ~(RASTER_BLOCK_SIZE - 1);
+		const rnd::i32 bystart = ymin & ~(RASTER_BLOCK_SIZE - 1);
+
+		rnd::u32 samples = 0;
+
+		for (rnd::i32 by = bystart; by <= ymax; by += RASTER_BLOCK_SIZE)
+		{
+			const rnd::i32 y0 = std::max(by, tileStartY);
+			const rnd::i32 y1 = std::min(by + RASTER_BLOCK_SIZE, tileEndY);
+
+			for (rnd::i32 bx = bxstart; bx <= xmax; bx += RASTER_BLOCK_SIZE)
+			{
+				const rnd::i64 w0 = ts.e12.Evaluate(bx, by);
+				const rnd::i64 w1 = ts.e20.Evaluate(bx, by);
+				const rnd::i64 w2 = ts.e01.Evaluate(bx, by);
+
+				// trivial reject: the whole block is outside one of the edges
+				if (w0 + e0_hi < 0 || w1 + e1_hi < 0 || w2 + e2_hi < 0)
+					continue;
+
+				// hierarchical z: the triangle is behind everything already drawn in this block
+				rnd::f32& block_max_depth = hiz_buffer[(by / RASTER_BLOCK_SIZE) * hiz_width + bx / RASTER_BLOCK_SIZE];
+				if (block_nearest_depth(bx, by) >= block_max_depth)
+					continue;
+
+				// trivial accept: the whole block is inside all three edges
+				const bool inside = w0 + e0_lo >= 0 && w1 + e1_lo >= 0 && w2 + e2_lo >= 0;
+
+				// lanes of the block that fall inside this tile
+				const vInt xs = vInt(bx) + ramp;
+				const vInt in_tile = mask_gt(xs, vInt(tileStartX - 1)) & mask_lt(xs, vInt(tileEndX));
+
+				// every pixel of the block gets tested, so its max depth can be refreshed afterwards
+				const bool full_block = inside && movemask(in_tile) == 0xff && y1 - y0 == RASTER_BLOCK_SIZE;
+
+				for (rnd::i32 y = y0; y < y1; ++y)
+				{
+					const rnd::i64 dy = y - by;
+					const rnd::i64 r0 = w0 + dy * ts.e12.B;
+					const rnd::i64 r1 = w1 + dy * ts.e20.B;
+					const rnd::i64 r2 = w2 + dy * ts.e01.B;
+
+					vInt mask = in_tile;
+
+					if (!inside)
+					{
+						// coverage: the sign bit of (e0 | e1 | e2) is clear for covered pixels
+						const vInt e0 = vInt(ClampEdge(r0)) + e0_lanes;
+						const vInt e1 = vInt(ClampEdge(r1)) + e1_lanes;
+						const vInt e2 = vInt(ClampEdge(r2)) + e2_lanes;
+
+						mask = andnot((e0 | e1 | e2) >> 31, mask);
+						if (movemask(mask) == 0)
+							continue;
+					}
+
+					samples += shade_span(bx, y, mask);
+				}
+
+				if (full_block)
+				{
+					const rnd::f32* depth_row = tile.depth + tile.Index(bx, by);
+
+					vFloat block_max = vFloat::load(depth_row);
+					for (rnd::i32 row = 1; row < RASTER_BLOCK_SIZE; ++row)
+						block_max = max(block_max, vFloat::load(depth_row + row * tile.stride));
+
+					block_max_depth = hmax(block_max);
+				}
+			}
+		}
+
+		return samples;
+	}
+};
+
+// Second pass of visibility buffer rendering, eight pixels at a time. The lanes of a row
+// span holding the same id are shaded together, so a triangle covering the span costs a
+// single ShadeSpan like in the forward kernel.
+template <typename ShaderProgram>
+struct TileResolveFunctor
+{
+	using Vertex = ShaderVertex<ShaderProgram>;
+
+	template <typename Resolve>
+	void operator()(int tileStartX, int tileStartY, int tileEndX, int tileEndY, TileBuffer& tile, Resolve&& resolve)
+	{
+		using namespace simd;
+
+		const vInt ramp = vInt::ramp();
+
+		for (rnd::i32 y = tileStartY; y < tileEndY; ++y)
+		{
+			for (rnd::i32 x = tileStartX; x < tileEndX; x += vInt::Length)
+			{
+				const vInt in_tile = mask_lt(vInt(x) + ramp, vInt(tileEndX));
+				const size_t index = tile.Index(x, y);
+				const vInt ids = vInt::load_masked(tile.visibility + index, in_tile);
+
+				vInt pending = andnot(mask_eq(ids, vInt(0)), in_tile);
+
+				while (int bits = movemask(pending))
+				{
+					const rnd::u32 id = (rnd::u32)ids[std::countr_zero((unsigned)bits)];
+					const vInt lanes = mask_eq(ids, vInt((rnd::i32)id)) & pending;
+					pending = andnot(lanes, pending);
+
+					const VisibleTriangle<ShaderProgram> v = resolve(id);
+					const Triangle<Vertex>& t = *v.triangle;
+
+					const rnd::f32 fy = (rnd::f32)(y - t.setup.ymin);
+					const vFloat fx = conv2f(vInt(x - t.setup.xmin) + ramp);
+
+					const vFloat one_over_z = EvalSpan(t.position[3], fy, fx);
+					const vFloat z = vFloat(1.f) / one_over_z;
+
+					ShadeSpan(t, v.planes, v.program, fy, fx, one_over_z, z, lanes, tile.color + index);
+				}
+			}
+		}
+	}
+};
+
+#endif
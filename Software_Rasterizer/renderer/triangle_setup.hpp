@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "types.hpp"
+#include "math/vector.hpp"
+
+// Screen space positions are snapped to 28.4 fixed point before rasterization,
+// so coverage is decided with exact integer math and adjacent triangles are watertight.
+static constexpr rnd::i32 SUBPIXEL_BITS = 4;
+static constexpr rnd::i32 SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+static constexpr rnd::i32 SUBPIXEL_HALF = SUBPIXEL_ONE / 2;
+
+// Coordinates are clamped to this range (in pixels) before snapping,
+// which keeps every edge equation comfortably inside 64 bits.
+static constexpr rnd::f32 FIXED_POINT_LIMIT = 16384.f;
+
+static inline rnd::i32 ToFixed(rnd::f32 v)
+{
+	return (rnd::i32)std::lrint(std::clamp(v, -FIXED_POINT_LIMIT, FIXED_POINT_LIMIT) * SUBPIXEL_ONE);
+}
+
+/// <summary>
+/// Edge equation E(x, y) = A * x + B * y + C evaluated at the center of pixel (x, y).
+/// Stepping one pixel right adds A, stepping one row down adds B.
+/// The fill rule bias is folded into C, so a pixel is covered when E >= 0.
+/// </summary>
+struct EdgeFunction
+{
+	rnd::i64 A, B, C;
+
+	inline rnd::i64 Evaluate(rnd::i32 x, rnd::i32 y) const
+	{
+		return A * x + B * y + C;
+	}
+};
+
+// Clamps an edge value into 32 bits without changing the sign of E + i * A for any lane.
+// |8 * A| stays below 2^27 with the fixed point limits, so 2^30 leaves plenty of headroom.
+static inline rnd::i32 ClampEdge(rnd::i64 e)
+{
+	return (rnd::i32)std::clamp<rnd::i64>(e, -(1 << 30), 1 << 30);
+}
+
+// Triangles are wound so that the interior is on the positive side of every edge.
+// With y pointing down, top edges go right and left edges go up.
+static inline bool IsTopLeft(rnd::i32 ax, rnd::i32 ay, rnd::i32 bx, rnd::i32 by)
+{
+	return (ay == by && bx > ax) || (by < ay);
+}
+
+static inline EdgeFunction MakeEdge(rnd::i32 ax, rnd::i32 ay, rnd::i32 bx, rnd::i32 by)
+{
+	const rnd::i64 dx = (rnd::i64)bx - ax;
+	const rnd::i64 dy = (rnd::i64)by - ay;
+
+	EdgeFunction e;
+	e.A = -dy * SUBPIXEL_ONE;
+	e.B = dx * SUBPIXEL_ONE;
+	e.C = dx * (SUBPIXEL_HALF - ay) - dy * (SUBPIXEL_HALF - ax);
+
+	if (!IsTopLeft(ax, ay, bx, by))
+		e.C -= 1;
+
+	return e;
+}
+
+/// <summary>
+/// Per triangle data needed by the rasterizer loops.
+/// e12, e20 and e01 are the edges opposite to v0, v1 and v2, so they double
+/// as (unnormalized) barycentric weights for those vertices.
+/// </summary>
+struct TriangleSetup
+{
+	EdgeFunction e12, e20, e01;
+
+	// inclusive pixel bounds of the snapped triangle
+	rnd::i32 xmin, ymin, xmax, ymax;
+
+	rnd::f32 rcp_area;
+};
+
+// Triangles whose bounding box is at most this many pixels across in both directions are
+// small: setup checks their pixel centers directly, and the rasterizer gives them a
+// single span per row instead of walking blocks.
+static constexpr rnd::i32 SMALL_TRIANGLE_SIZE = 4;
+
+static inline bool IsSmallTriangle(const TriangleSetup& ts)
+{
+	return ts.xmax - ts.xmin < SMALL_TRIANGLE_SIZE && ts.ymax - ts.ymin < SMALL_TRIANGLE_SIZE;
+}
+
+// True when a pixel center of the (small) triangle's bounding box is inside all three edges.
+static inline bool CoversAnySample(const TriangleSetup& ts)
+{
+	for (rnd::i32 y = ts.ymin; y <= ts.ymax; ++y)
+	{
+		rnd::i64 w0 = ts.e12.Evaluate(ts.xmin, y);
+		rnd::i64 w1 = ts.e20.Evaluate(ts.xmin, y);
+		rnd::i64 w2 = ts.e01.Evaluate(ts.xmin, y);
+
+		for (rnd::i32 x = ts.xmin; x <= ts.xmax; ++x, w0 += ts.e12.A, w1 += ts.e20.A, w2 += ts.e01.A)
+		{
+			if ((w0 | w1 | w2) >= 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+/// <summary>
+/// Snaps the three screen space positions and builds the edge equations.
+/// Expects the winding the renderer produces after backface culling (positive area).
+/// Returns false when the snapped triangle is degenerate, wound the other way, or
+/// covers no pixel center (an empty bounding box, or a small triangle missing all of them).
+/// </summary>
+static inline bool SetupTriangle(const math::vec4& p0, const math::vec4& p1, const math::vec4& p2, TriangleSetup& out)
+{
+	const rnd::i32 x0 = ToFixed(p0.x), y0 = ToFixed(p0.y);
+	const rnd::i32 x1 = ToFixed(p1.x), y1 = ToFixed(p1.y);
+	const rnd::i32 x2 = ToFixed(p2.x), y2 = ToFixed(p2.y);
+
+	const rnd::i64 area = ((rnd::i64)x1 - x0) * ((rnd::i64)y2 - y0) - ((rnd::i64)y1 - y0) * ((rnd::i64)x2 - x0);
+	if (area <= 0)
+		return false;
+
+	out.e12 = MakeEdge(x1, y1, x2, y2);
+	out.e20 = MakeEdge(x2, y2, x0, y0);
+	out.e01 = MakeEdge(x0, y0, x1, y1);
+
+	// first/last pixel whose center lies inside the snapped bounds
+	out.xmin = (std::min({ x0, x1, x2 }) + SUBPIXEL_HALF - 1) >> SUBPIXEL_BITS;
+	out.ymin = (std::min({ y0, y1, y2 }) + SUBPIXEL_HALF - 1) >> SUBPIXEL_BITS;
+	out.xmax = (std::max({ x0, x1, x2 }) - SUBPIXEL_HALF) >> SUBPIXEL_BITS;
+	out.ymax = (std::max({ y0, y1, y2 }) - SUBPIXEL_HALF) >> SUBPIXEL_BITS;
+
+	if (out.xmin > out.xmax || out.ymin > out.ymax)
+		return false;
+
+	if (IsSmallTriangle(out) && !CoversAnySample(out))
+		return false;
+
+	out.rcp_area = 1.f / (rnd::f32)area;
+
+	return true;
+}
+
+/// <summary>
+/// Screen space plane of a linearly interpolated quantity (1/w or attribute/w).
+/// Anchored at the center of the triangle's first bounding box pixel (x0, y0),
+/// so the offsets stay small and exactly representable.
+/// </summary>
+struct AttributePlane
+{
+	rnd::f32 dx, dy, c;
+
+	inline rnd::f32 At(rnd::f32 fx, rnd::f32 fy) const
+	{
+		return (c + dy * fy) + dx * fx;
+	}
+};
+
+/// <summary>
+/// Barycentric gradients of a triangle, used to turn per-vertex values into planes.
+/// b0 * v0 + b1 * v1 + b2 * v2 gives the plane of any vertex quantity.
+/// </summary>
+struct BarycentricPlanes
+{
+	AttributePlane b0, b1, b2;
+
+	inline AttributePlane Make(rnd::f32 v0, rnd::f32 v1, rnd::f32 v2) const
+	{
+		return {
+			v0 * b0.dx + v1 * b1.dx + v2 * b2.dx,
+			v0 * b0.dy + v1 * b1.dy + v2 * b2.dy,
+			v0 * b0.c + v1 * b1.c + v2 * b2.c
+		};
+	}
+};
+
+static inline BarycentricPlanes MakeBarycentricPlanes(const TriangleSetup& ts)
+{
+	auto make = [&](const EdgeFunction& e) {
+		return AttributePlane{
+			(rnd::f32)e.A * ts.rcp_area,
+			(rnd::f32)e.B * ts.rcp_area,
+			(rnd::f32)e.Evaluate(ts.xmin, ts.ymin) * ts.rcp_area
+		};
+	};
+
+	return { make(ts.e12), make(ts.e20), make(ts.e01) };
+}
@@ -3,7 +3,12 @@
 #include "math/vector.hpp"
 #include "generic_value.hpp"
 
+#include <algorithm>
 #include <array>
+#include <concepts>
+#include <cstring>
+#include <type_traits>
+#include <utility>
 
 struct VSInput
 {
@@ -127,4 +132,120 @@ inline math::vec4 VSOutput::getVarying(uint32_t loc) const
 	math::vec4 result;
 	memcpy(&result, val.vals, sizeof(float) * val.count);
 	return result;
-}
\ No newline at end of file
+}
+
+/// <summary>
+/// Vertex shader output with shader-declared varyings, e.g.
+///
+///	struct Varyings { math::vec3 color; math::vec2 tc; };
+///	TypedVSOutput<Varyings> operator()(const VSInput& in) const;
+///
+/// The varyings must be a plain struct of floats. Its layout is known at compile time, so
+/// perspective correction and interpolation are fixed-length loops over exactly its floats
+/// instead of walking GenericValue slots.
+/// </summary>
+template <typename Varyings>
+struct TypedVSOutput
+{
+	static_assert(std::is_trivially_copyable_v<Varyings> && std::is_standard_layout_v<Varyings>, "varyings must be a plain struct");
+	static_assert(sizeof(Varyings) % sizeof(float) == 0, "varyings must only contain floats");
+
+	static constexpr size_t NUM_FLOATS = sizeof(Varyings) / sizeof(float);
+
+	inline float* Floats() { return reinterpret_cast<float*>(&varyings); }
+	inline const float* Floats() const { return reinterpret_cast<const float*>(&varyings); }
+
+	math::vec4 Position = {};
+	Varyings varyings = {};
+};
+
+template <typename T>
+struct IsTypedVSOutput : std::false_type {};
+
+template <typename Varyings>
+struct IsTypedVSOutput<TypedVSOutput<Varyings>> : std::true_type {};
+
+// The per-vertex type the pipeline carries for a shader program: whatever its vertex shader returns.
+template <typename ShaderProgram>
+using ShaderVertex = std::remove_cvref_t<decltype(std::declval<const ShaderProgram&>().vs(std::declval<const VSInput&>()))>;
+
+// Vertex shaders that can compute the clip space position alone, without the varyings.
+// Used when only the geometry matters, e.g. for occluders.
+template <typename ShaderProgram>
+concept PositionVertexShader = requires(const ShaderProgram& p, const VSInput& in)
+{
+	{ p.vs.position(in) } -> std::same_as<math::vec4>;
+};
+
+// Upper bound of the number of varying floats (and attribute planes) of a vertex type.
+template <typename Vertex>
+constexpr size_t MaxVaryingFloats = VSOutput::MAX_VARYINGS * 4;
+
+template <typename Varyings>
+constexpr size_t MaxVaryingFloats<TypedVSOutput<Varyings>> = std::max<size_t>(TypedVSOutput<Varyings>::NUM_FLOATS, 1);
+
+/// <summary>
+/// How the varyings of a vertex map onto a flat run of floats (one attribute plane each).
+/// GenericValue slots record their component counts, typed varyings know it at compile time.
+/// </summary>
+template <typename Vertex>
+struct VaryingLayout;
+
+template <>
+struct VaryingLayout<VSOutput>
+{
+	rnd::u8 used = 0;
+	rnd::u8 counts[VSOutput::MAX_VARYINGS] = { 0 };
+	rnd::u8 numFloats = 0;
+
+	static VaryingLayout Of(const VSOutput& v)
+	{
+		VaryingLayout layout;
+		layout.used = (rnd::u8)v.Size();
+		for (size_t j = 0; j < v.Size(); ++j)
+		{
+			layout.counts[j] = (rnd::u8)v.varyings[j].count;
+			layout.numFloats += layout.counts[j];
+		}
+		return layout;
+	}
+
+	inline size_t NumFloats() const { return numFloats; }
+
+	void Gather(const VSOutput& v, float* out) const
+	{
+		for (size_t j = 0; j < used; ++j)
+			for (size_t k = 0; k < counts[j]; ++k)
+				*out++ = v.varyings[j].vals[k];
+	}
+
+	void Scatter(const float* in, VSOutput& v) const
+	{
+		v.used = used;
+		for (size_t j = 0; j < used; ++j)
+		{
+			GenericValue& gv = v.varyings[j];
+			gv.count = counts[j];
+			for (size_t k = 0; k < counts[j]; ++k)
+				gv.vals[k] = *in++;
+		}
+	}
+};
+
+template <typename Varyings>
+struct VaryingLayout<TypedVSOutput<Varyings>>
+{
+	static VaryingLayout Of(const TypedVSOutput<Varyings>&) { return {}; }
+
+	static constexpr size_t NumFloats() { return TypedVSOutput<Varyings>::NUM_FLOATS; }
+
+	void Gather(const TypedVSOutput<Varyings>& v, float* out) const
+	{
+		memcpy(out, v.Floats(), NumFloats() * sizeof(float));
+	}
+
+	void Scatter(const float* in, TypedVSOutput<Varyings>& v) const
+	{
+		memcpy(v.Floats(), in, NumFloats() * sizeof(float));
+	}
+};
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <array>
+#include <concepts>
+
+#include "simd.h"
+#include "math/matrix.hpp"
+#include "varying.hpp"
+
+// SoA counterparts of VSInput/VSOutput for shaders that process
+// simd::vFloat::Length vertices or pixels per call. A shader program opts in by
+// giving its vertex and/or fragment shader an overload taking the batch types:
+//
+//	VSOutputBatch operator()(const VSInputBatch& in) const;
+//	simd::vFloat4 operator()(const VSOutputBatch& in, const simd::vInt& mask) const;
+//
+// Lanes past VSInputBatch::count hold copies of the last valid vertex.
+// The fragment shader gets the interpolated varyings of eight horizontally
+// adjacent pixels; lanes that are not set in mask are discarded.
+
+struct VSInputBatch
+{
+	static constexpr size_t WIDTH = simd::vFloat::Length;
+
+	void Set(size_t slot, size_t lane, const GenericValue& value)
+	{
+		assert(slot < MAX_ATTRIBS);
+		counts[slot] = value.count;
+		for (size_t c = 0; c < value.count; ++c)
+			attribs[slot][c][lane] = value.vals[c];
+	}
+
+	template <typename T>
+	T Get(size_t slot) const;
+
+	size_t count = 0;
+
+private:
+	static constexpr size_t MAX_ATTRIBS = 16;
+	std::array<std::array<simd::vFloat, 4>, MAX_ATTRIBS> attribs;
+	std::array<size_t, MAX_ATTRIBS> counts = { 0 };
+};
+
+template <>
+inline simd::vFloat2 VSInputBatch::Get<simd::vFloat2>(size_t slot) const
+{
+	assert(slot < MAX_ATTRIBS);
+	assert(counts[slot] == 2);
+	return { attribs[slot][0], attribs[slot][1] };
+}
+
+template <>
+inline simd::vFloat3 VSInputBatch::Get<simd::vFloat3>(size_t slot) const
+{
+	assert(slot < MAX_ATTRIBS);
+	assert(counts[slot] == 3);
+	return { attribs[slot][0], attribs[slot][1], attribs[slot][2] };
+}
+
+template <>
+inline simd::vFloat4 VSInputBatch::Get<simd::vFloat4>(size_t slot) const
+{
+	assert(slot < MAX_ATTRIBS);
+	assert(counts[slot] == 4);
+	return { attribs[slot][0], attribs[slot][1], attribs[slot][2], attribs[slot][3] };
+}
+
+struct VSOutputBatch
+{
+	template <typename V>
+	void setVarying(uint32_t location, const V& var)
+	{
+		assert(location < VSOutput::MAX_VARYINGS);
+		assert(location == used && "location must be the next unused slot");
+
+		if constexpr (std::is_same_v<V, simd::vFloat2>)
+		{
+			varyings[location] = { var.x, var.y };
+			counts[location] = 2;
+		}
+		else if constexpr (std::is_same_v<V, simd::vFloat3>)
+		{
+			varyings[location] = { var.x, var.y, var.z };
+			counts[location] = 3;
+		}
+		else
+		{
+			assert(false && "Not implemented yet");
+		}
+
+		used += 1;
+	}
+
+	template <typename T>
+	T getVarying(uint32_t loc) const;
+
+	// Unpacks one lane into the per-vertex layout the rest of the pipeline uses.
+	void Extract(size_t lane, VSOutput& out) const
+	{
+		out.Position = { Position.x[lane], Position.y[lane], Position.z[lane], Position.w[lane] };
+		out.used = used;
+
+		for (size_t j = 0; j < used; ++j)
+		{
+			GenericValue val = {};
+			val.count = counts[j];
+			for (size_t c = 0; c < counts[j]; ++c)
+				val.vals[c] = varyings[j][c][lane];
+			out.varyings[j] = val;
+		}
+	}
+
+	simd::vFloat4 Position;
+
+	size_t used = 0;
+	std::array<std::array<simd::vFloat, 4>, VSOutput::MAX_VARYINGS> varyings;
+	std::array<size_t, VSOutput::MAX_VARYINGS> counts = { 0 };
+};
+
+template <>
+inline simd::vFloat2 VSOutputBatch::getVarying<simd::vFloat2>(uint32_t loc) const
+{
+	assert(loc < VSOutput::MAX_VARYINGS);
+	assert(counts[loc] == 2);
+	return { varyings[loc][0], varyings[loc][1] };
+}
+
+template <>
+inline simd::vFloat3 VSOutputBatch::getVarying<simd::vFloat3>(uint32_t loc) const
+{
+	assert(loc < VSOutput::MAX_VARYINGS);
+	assert(counts[loc] == 3);
+	return { varyings[loc][0], varyings[loc][1], varyings[loc][2] };
+}
+
+template <>
+inline simd::vFloat4 VSOutputBatch::getVarying<simd::vFloat4>(uint32_t loc) const
+{
+	assert(loc < VSOutput::MAX_VARYINGS);
+	assert(counts[loc] == 4);
+	return { varyings[loc][0], varyings[loc][1], varyings[loc][2], varyings[loc][3] };
+}
+
+template <typename ShaderProgram>
+concept BatchedVertexShader = requires(const ShaderProgram& p, const VSInputBatch& in)
+{
+	{ p.vs(in) } -> std::same_as<VSOutputBatch>;
+};
+
+template <typename ShaderProgram>
+concept BatchedFragmentShader = requires(const ShaderProgram& p, const VSOutputBatch& in, const simd::vInt& mask)
+{
+	{ p.fs(in, mask) } -> std::same_as<simd::vFloat4>;
+};
+
+namespace simd
+{
+	// Same operation order as math::operator*(mat4, vec4), so both paths give identical results.
+	inline vFloat4 operator*(const math::mat4& m, const vFloat4& v)
+	{
+		const rnd::f32* a = m.values;
+		return {
+			vFloat(a[0]) * v.x + vFloat(a[4]) * v.y + vFloat(a[8]) * v.z + vFloat(a[12]) * v.w,
+			vFloat(a[1]) * v.x + vFloat(a[5]) * v.y + vFloat(a[9]) * v.z + vFloat(a[13]) * v.w,
+			vFloat(a[2]) * v.x + vFloat(a[6]) * v.y + vFloat(a[10]) * v.z + vFloat(a[14]) * v.w,
+			vFloat(a[3]) * v.x + vFloat(a[7]) * v.y + vFloat(a[11]) * v.z + vFloat(a[15]) * v.w
+		};
+	}
+}
@@ -23,6 +23,7 @@ namespace rasterizer
 		struct mesh mesh;
 		enum cull_mode cull_mode = cull_mode::none;
 		depth_settings depth = {};
+		enum blend_mode blend_mode = blend_mode::none;
 
 		matrix4x4f model = matrix4x4f::identity();
 		matrix4x4f view = matrix4x4f::identity();
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <type_traits>
 
 namespace rasterizer
 {
@@ -157,287 +158,475 @@ namespace rasterizer
 			return end;
 		}
 
-		bool depth_test_passed(depth_test_mode mode, std::uint32_t value, std::uint32_t reference)
+		// Screen space positions are snapped to 28.4 fixed point, so coverage is
+		// decided with exact integer math and shared edges are rasterized exactly once.
+		constexpr std::int32_t subpixel_bits = 4;
+		constexpr std::int32_t subpixel_one = 1 << subpixel_bits;
+		constexpr std::int32_t subpixel_half = subpixel_one / 2;
+		constexpr float fixed_point_limit = 16384.f;
+
+		std::int32_t to_fixed(float value)
+		{
+			return static_cast<std::int32_t>(std::lrint(std::max(-fixed_point_limit, std::min(fixed_point_limit, value)) * subpixel_one));
+		}
+
+		// E(x, y) = a * x + b * y + c at the center of pixel (x, y), fill rule bias included
+		struct edge_function
 		{
-			switch (mode)
+			std::int64_t a, b, c;
+
+			std::int64_t at(std::int32_t x, std::int32_t y) const
 			{
-			case depth_test_mode::always: return true;
-			case depth_test_mode::never: return false;
-			case depth_test_mode::less: return value < reference;
-			case depth_test_mode::less_equal: return value <= reference;
-			case depth_test_mode::greater: return value > reference;
-			case depth_test_mode::greater_equal: return value >= reference;
-			case depth_test_mode::equal: return value == reference;
-			case depth_test_mode::not_equal: return value != reference;
+				return a * x + b * y + c;
 			}
+		};
 
-			// Unreachable
-			return true;
+		// With y pointing down and the interior on the positive side,
+		// top edges go right and left edges go up
+		bool is_top_left(std::int32_t ax, std::int32_t ay, std::int32_t bx, std::int32_t by)
+		{
+			return (ay == by && bx > ax) || (by < ay);
 		}
 
-	}
+		edge_function make_edge(std::int32_t ax, std::int32_t ay, std::int32_t bx, std::int32_t by)
+		{
+			std::int64_t const dx = std::int64_t(bx) - ax;
+			std::int64_t const dy = std::int64_t(by) - ay;
 
-	void clear(image_view<color4ub> const & color_buffer, vector4f const & color)
-	{
-		auto ptr = color_buffer.pixels;
-		auto size = color_buffer.width * color_buffer.height;
-		std::fill(ptr, ptr + size, to_color4ub(color));
-	}
+			edge_function e;
+			e.a = -dy * subpixel_one;
+			e.b = dx * subpixel_one;
+			e.c = dx * (subpixel_half - ay) - dy * (subpixel_half - ax);
 
-	void clear(image_view<std::uint32_t> const & depth_buffer, std::uint32_t value)
-	{
-		auto ptr = depth_buffer.pixels;
-		auto size = depth_buffer.width * depth_buffer.height;
-		std::fill(ptr, ptr + size, value);
-	}
+			if (!is_top_left(ax, ay, bx, by))
+				e.c -= 1;
 
-	void draw(framebuffer const & framebuffer, viewport const & viewport, draw_command const & command)
-	{
-		auto view_projection = command.projection * command.view;
+			return e;
+		}
+
+		template <depth_test_mode Mode>
+		bool depth_test_passed(std::uint32_t value, std::uint32_t reference)
+		{
+			if constexpr (Mode == depth_test_mode::always) return true;
+			if constexpr (Mode == depth_test_mode::never) return false;
+			if constexpr (Mode == depth_test_mode::less) return value < reference;
+			if constexpr (Mode == depth_test_mode::less_equal) return value <= reference;
+			if constexpr (Mode == depth_test_mode::greater) return value > reference;
+			if constexpr (Mode == depth_test_mode::greater_equal) return value >= reference;
+			if constexpr (Mode == depth_test_mode::equal) return value == reference;
+			if constexpr (Mode == depth_test_mode::not_equal) return value != reference;
+		}
 
-		for (std::uint32_t vertex_index = 0; vertex_index + 2 < command.mesh.count; vertex_index += 3)
+		template <filtering Filter>
+		vector4f sample(image<color4ub> const & mipmap, vector2f const & texcoord)
 		{
-			std::uint32_t indices[3]
+			vector2f tc;
+			tc.x = mipmap.width * std::fmod(texcoord.x, 1.f);
+			tc.y = mipmap.height * std::fmod(texcoord.y, 1.f);
+
+			if (Filter == filtering::nearest || mipmap.width == 1 || mipmap.height == 1)
+			{
+				int ix = std::floor(tc.x);
+				int iy = std::floor(tc.y);
+
+				return to_vector4f(mipmap.at(ix, iy));
+			}
+
+			tc.x -= 0.5f;
+			tc.y -= 0.5f;
+
+			tc.x = std::max(0.f, std::min(mipmap.width - 1.f, tc.x));
+			tc.y = std::max(0.f, std::min(mipmap.height - 1.f, tc.y));
+
+			int ix = std::min<int>(mipmap.width - 2, std::floor(tc.x));
+			int iy = std::min<int>(mipmap.height - 2, std::floor(tc.y));
+
+			tc.x -= ix;
+			tc.y -= iy;
+
+			vector4f samples[4]
 			{
-				vertex_index + 0,
-				vertex_index + 1,
-				vertex_index + 2,
+				to_vector4f(mipmap.at(ix + 0, iy + 0)),
+				to_vector4f(mipmap.at(ix + 1, iy + 0)),
+				to_vector4f(mipmap.at(ix + 0, iy + 1)),
+				to_vector4f(mipmap.at(ix + 1, iy + 1)),
 			};
 
-			if (command.mesh.indices)
-				for (int i = 0; i < 3; ++i)
-					indices[i] = command.mesh.indices[indices[i]];
+			return (1.f - tc.y) * ((1.f - tc.x) * samples[0] + tc.x * samples[1]) + tc.y * ((1.f - tc.x) * samples[2] + tc.x * samples[3]);
+		}
+
+		// The filters are known at compile time, whether a pixel is magnified is not
+		template <filtering MagFilter, filtering MinFilter>
+		vector4f sample_albedo(texture<color4ub> const & texture, vector2f const & texture_scale, vector2f const (&texcoord)[2][2], int dx, int dy)
+		{
+			vector2f tc_dx = texture_scale * (texcoord[dy][1] - texcoord[dy][0]);
+			vector2f tc_dy = texture_scale * (texcoord[1][dx] - texcoord[0][dx]);
+
+			float texel_area = 1.f / std::abs(det2D(tc_dx, tc_dy));
 
-			vertex clipped_vertices[12];
+			if (texel_area >= 1.f)
+				return sample<MagFilter>(texture.mipmaps[0], texcoord[dy][dx]);
 
-			for (int i = 0; i < 3; ++i)
+			int mipmap_level = std::ceil(-std::log2(std::min(1.f, texel_area)) / 2.f);
+
+			return sample<MinFilter>(texture.mipmaps[std::min<int>(mipmap_level, texture.mipmaps.size() - 1)], texcoord[dy][dx]);
+		}
+
+		vector4f apply_lighting(light_settings const & lights, vector4f const & color, vector3f const & normal, vector3f const & position)
+		{
+			vector3f lighting = lights.ambient_light;
+
+			for (auto const & light : lights.directional_lights)
 			{
-				clipped_vertices[i].world_position = to_vector3f(command.model * as_point(command.mesh.positions[indices[i]]));
-				clipped_vertices[i].position = view_projection * as_point(clipped_vertices[i].world_position);
-				clipped_vertices[i].normal = to_vector3f(command.model * as_vector(command.mesh.normals[indices[i]]));
-				clipped_vertices[i].color = command.mesh.colors[indices[i]];
-				clipped_vertices[i].texcoord = command.mesh.texcoords[indices[i]];
+				lighting = lighting + std::max(0.f, dot(light.direction, normal)) * light.intensity;
 			}
 
-			auto clipped_vertices_end = clip_triangle(clipped_vertices, clipped_vertices + 3);
-
-			for (auto triangle_begin = clipped_vertices; triangle_begin != clipped_vertices_end; triangle_begin += 3)
+			for (auto const & light : lights.point_lights)
 			{
-				auto v0 = triangle_begin[0];
-				auto v1 = triangle_begin[1];
-				auto v2 = triangle_begin[2];
+				vector3f delta = light.position - position;
+				float distance = length(delta);
+				vector3f direction = delta / distance;
+				float attenuation = 1.f / (light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance);
+
+				lighting = lighting + std::max(0.f, dot(direction, normal)) * attenuation * light.intensity;
+			}
+
+			auto result = lighting * to_vector3f(color);
+
+			return {result.x, result.y, result.z, color.w};
+		}
 
-				v0.position = perspective_divide(v0.position);
-				v1.position = perspective_divide(v1.position);
-				v2.position = perspective_divide(v2.position);
+		// Everything the per pixel work of a draw depends on. The rasterization kernel is
+		// instantiated for exactly one of these, so the tests below fold away at compile time.
+		template <depth_test_mode DepthTest, bool DepthWrite, bool ColorWrite, blend_mode Blend, bool Textured, filtering MagFilter, filtering MinFilter, bool Lit>
+		struct pipeline_state
+		{
+			static constexpr depth_test_mode depth_test = DepthTest;
+			static constexpr bool depth_write = DepthWrite;
+			static constexpr bool color_write = ColorWrite;
+			static constexpr blend_mode blend = Blend;
+			static constexpr bool textured = Textured;
+			static constexpr filtering mag_filter = MagFilter;
+			static constexpr filtering min_filter = MinFilter;
+			static constexpr bool lit = Lit;
+
+			// Without a depth test or depth write the depth buffer is never touched
+			static constexpr bool uses_depth = depth_test != depth_test_mode::always || depth_write;
+		};
 
-				v0.position = apply(viewport, v0.position);
-				v1.position = apply(viewport, v1.position);
-				v2.position = apply(viewport, v2.position);
+		// Expects screen space vertices in clockwise order
+		using rasterize_function = void (*)(framebuffer const & framebuffer, viewport const & viewport, draw_command const & command, vertex const & v0, vertex const & v1, vertex const & v2);
 
-				float det012 = det2D(v1.position - v0.position, v2.position - v0.position);
+		template <typename State>
+		void rasterize_triangle(framebuffer const & framebuffer, viewport const & viewport, draw_command const & command, vertex const & v0, vertex const & v1, vertex const & v2)
+		{
+			std::int32_t const fx0 = to_fixed(v0.position.x), fy0 = to_fixed(v0.position.y);
+			std::int32_t const fx1 = to_fixed(v1.position.x), fy1 = to_fixed(v1.position.y);
+			std::int32_t const fx2 = to_fixed(v2.position.x), fy2 = to_fixed(v2.position.y);
 
-				bool const ccw = det012 < 0.f;
+			std::int64_t const area = (std::int64_t(fx1) - fx0) * (std::int64_t(fy2) - fy0) - (std::int64_t(fy1) - fy0) * (std::int64_t(fx2) - fx0);
 
-				switch (command.cull_mode)
-				{
-				case cull_mode::none:
-					if (ccw)
-					{
-						std::swap(v1, v2);
-						det012 = -det012;
-					}
-					break;
-				case cull_mode::cw:
-					if (!ccw)
-						continue;
-					std::swap(v1, v2);
-					det012 = -det012;
-					break;
-				case cull_mode::ccw:
-					if (ccw)
-						continue;
-					break;
-				}
+			// Degenerate after snapping
+			if (area <= 0)
+				return;
+
+			float const inv_area = 1.f / area;
 
-				std::int32_t xmin = std::max<std::int32_t>(viewport.xmin, 0);
-				std::int32_t xmax = std::min<std::int32_t>(viewport.xmax, framebuffer.width()) - 1;
-				std::int32_t ymin = std::max<std::int32_t>(viewport.ymin, 0);
-				std::int32_t ymax = std::min<std::int32_t>(viewport.ymax, framebuffer.height()) - 1;
+			edge_function const e01 = make_edge(fx0, fy0, fx1, fy1);
+			edge_function const e12 = make_edge(fx1, fy1, fx2, fy2);
+			edge_function const e20 = make_edge(fx2, fy2, fx0, fy0);
 
-				xmin = std::max<float>(xmin, std::min({std::floor(v0.position.x), std::floor(v1.position.x), std::floor(v2.position.x)}));
-				xmax = std::min<float>(xmax, std::max({std::floor(v0.position.x), std::floor(v1.position.x), std::floor(v2.position.x)}));
-				ymin = std::max<float>(ymin, std::min({std::floor(v0.position.y), std::floor(v1.position.y), std::floor(v2.position.y)}));
-				ymax = std::min<float>(ymax, std::max({std::floor(v0.position.y), std::floor(v1.position.y), std::floor(v2.position.y)}));
+			std::int32_t xmin = std::max<std::int32_t>(viewport.xmin, 0);
+			std::int32_t xmax = std::min<std::int32_t>(viewport.xmax, framebuffer.width()) - 1;
+			std::int32_t ymin = std::max<std::int32_t>(viewport.ymin, 0);
+			std::int32_t ymax = std::min<std::int32_t>(viewport.ymax, framebuffer.height()) - 1;
 
-				for (std::int32_t y = ymin; y <= ymax; y += 2)
+			// First/last pixel whose center lies inside the snapped bounds
+			xmin = std::max(xmin, (std::min({fx0, fx1, fx2}) + subpixel_half - 1) >> subpixel_bits);
+			xmax = std::min(xmax, (std::max({fx0, fx1, fx2}) - subpixel_half) >> subpixel_bits);
+			ymin = std::max(ymin, (std::min({fy0, fy1, fy2}) + subpixel_half - 1) >> subpixel_bits);
+			ymax = std::min(ymax, (std::max({fy0, fy1, fy2}) - subpixel_half) >> subpixel_bits);
+
+			texture<color4ub> const * texture = nullptr;
+			vector2f texture_scale;
+
+			if constexpr (State::textured)
+			{
+				texture = command.albedo->texture;
+				texture_scale = {(float)texture->width(), (float)texture->height()};
+			}
+
+			// Edge values are stepped incrementally, two pixels at a time
+			std::int64_t e01_row = e01.at(xmin, ymin);
+			std::int64_t e12_row = e12.at(xmin, ymin);
+			std::int64_t e20_row = e20.at(xmin, ymin);
+
+			for (std::int32_t y = ymin; y <= ymax; y += 2, e01_row += 2 * e01.b, e12_row += 2 * e12.b, e20_row += 2 * e20.b)
+			{
+				std::int64_t e01_quad = e01_row;
+				std::int64_t e12_quad = e12_row;
+				std::int64_t e20_quad = e20_row;
+
+				for (std::int32_t x = xmin; x <= xmax; x += 2, e01_quad += 2 * e01.a, e12_quad += 2 * e12.a, e20_quad += 2 * e20.a)
 				{
-					for (std::int32_t x = xmin; x <= xmax; x += 2)
-					{
-						float det01p[2][2];
-						float det12p[2][2];
-						float det20p[2][2];
+					std::int64_t det01p[2][2];
+					std::int64_t det12p[2][2];
+					std::int64_t det20p[2][2];
 
-						float l0[2][2];
-						float l1[2][2];
-						float l2[2][2];
+					float l0[2][2];
+					float l1[2][2];
+					float l2[2][2];
 
-						vector2f texcoord[2][2];
+					vector2f texcoord[2][2];
 
-						for (int dy = 0; dy < 2; ++dy)
+					for (int dy = 0; dy < 2; ++dy)
+					{
+						for (int dx = 0; dx < 2; ++dx)
 						{
-							for (int dx = 0; dx < 2; ++dx)
-							{
-								vector4f p{x + dx + 0.5f, y + dy + 0.5f, 0.f, 0.f};
-
-								det01p[dy][dx] = det2D(v1.position - v0.position, p - v0.position);
-								det12p[dy][dx] = det2D(v2.position - v1.position, p - v1.position);
-								det20p[dy][dx] = det2D(v0.position - v2.position, p - v2.position);
+							det01p[dy][dx] = e01_quad + dx * e01.a + dy * e01.b;
+							det12p[dy][dx] = e12_quad + dx * e12.a + dy * e12.b;
+							det20p[dy][dx] = e20_quad + dx * e20.a + dy * e20.b;
 
-								l0[dy][dx] = det12p[dy][dx] / det012 * v0.position.w;
-								l1[dy][dx] = det20p[dy][dx] / det012 * v1.position.w;
-								l2[dy][dx] = det01p[dy][dx] / det012 * v2.position.w;
+							l0[dy][dx] = det12p[dy][dx] * inv_area * v0.position.w;
+							l1[dy][dx] = det20p[dy][dx] * inv_area * v1.position.w;
+							l2[dy][dx] = det01p[dy][dx] * inv_area * v2.position.w;
 
-								float lsum = l0[dy][dx] + l1[dy][dx] + l2[dy][dx];
+							float lsum = l0[dy][dx] + l1[dy][dx] + l2[dy][dx];
 
-								l0[dy][dx] /= lsum;
-								l1[dy][dx] /= lsum;
-								l2[dy][dx] /= lsum;
+							l0[dy][dx] /= lsum;
+							l1[dy][dx] /= lsum;
+							l2[dy][dx] /= lsum;
 
+							// The whole quad is needed for the texture footprint
+							if constexpr (State::textured)
 								texcoord[dy][dx] = l0[dy][dx] * v0.texcoord + l1[dy][dx] * v1.texcoord + l2[dy][dx] * v2.texcoord;
-							}
 						}
+					}
 
-						for (int dy = 0; dy < 2; ++dy)
+					for (int dy = 0; dy < 2; ++dy)
+					{
+						for (int dx = 0; dx < 2; ++dx)
 						{
-							for (int dx = 0; dx < 2; ++dx)
-							{
-								if (x + dx > xmax)
-									continue;
+							if (x + dx > xmax)
+								continue;
 
-								if (y + dy > ymax)
-									continue;
+							if (y + dy > ymax)
+								continue;
 
-								if (det01p[dy][dx] < 0.f || det12p[dy][dx] < 0.f || det20p[dy][dx] < 0.f)
-									continue;
+							if ((det01p[dy][dx] | det12p[dy][dx] | det20p[dy][dx]) < 0)
+								continue;
 
+							if constexpr (State::uses_depth)
+							{
 								auto ndc_position = l0[dy][dx] * v0.position + l1[dy][dx] * v1.position + l2[dy][dx] * v2.position;
 
 								std::uint32_t depth = (0.5f + 0.5f * ndc_position.z) * std::uint32_t(-1);
 
-								if (framebuffer.depth)
-								{
-									if (!depth_test_passed(command.depth.mode, depth, framebuffer.depth.at(x + dx, y + dy)))
-										continue;
-
-									if (command.depth.write)
-										framebuffer.depth.at(x + dx, y + dy) = depth;
-								}
+								auto & depth_value = framebuffer.depth.at(x + dx, y + dy);
 
-								if (!framebuffer.color)
+								if (!depth_test_passed<State::depth_test>(depth, depth_value))
 									continue;
 
-								auto color = l0[dy][dx] * v0.color + l1[dy][dx] * v1.color + l2[dy][dx] * v2.color;
+								if constexpr (State::depth_write)
+									depth_value = depth;
+							}
 
-								if (command.albedo)
-								{
-									auto texture = command.albedo->texture;
-
-									vector2f texture_scale { texture->width(), texture->height() };
-
-									vector2f tc = texture_scale * texcoord[dy][dx];
-									vector2f tc_dx = texture_scale * (texcoord[dy][1] - texcoord[dy][0]);
-									vector2f tc_dy = texture_scale * (texcoord[1][dx] - texcoord[0][dx]);
-
-									float texel_area = 1.f / std::abs(det2D(tc_dx, tc_dy));
-									bool magnification = texel_area >= 1.f;
-
-									image<color4ub> const * mipmap;
-									filtering filter;
-
-									if (magnification)
-									{
-										mipmap = &texture->mipmaps[0];
-										filter = command.albedo->sampler.mag_filter;
-									}
-									else
-									{
-										int mipmap_level = std::ceil(-std::log2(std::min(1.f, texel_area)) / 2.f);
-
-										mipmap = &texture->mipmaps[std::min<int>(mipmap_level, texture->mipmaps.size() - 1)];
-										filter = command.albedo->sampler.min_filter;
-									}
-
-									tc.x = mipmap->width * std::fmod(texcoord[dy][dx].x, 1.f);
-									tc.y = mipmap->height * std::fmod(texcoord[dy][dx].y, 1.f);
-
-									if (filter == filtering::nearest || mipmap->width == 1 || mipmap->height == 1)
-									{
-										int ix = std::floor(tc.x);
-										int iy = std::floor(tc.y);
-
-										color = to_vector4f(mipmap->at(ix, iy));
-									}
-									else
-									{
-										tc.x -= 0.5f;
-										tc.y -= 0.5f;
-
-										tc.x = std::max(0.f, std::min(mipmap->width - 1.f, tc.x));
-										tc.y = std::max(0.f, std::min(mipmap->height - 1.f, tc.y));
-
-										int ix = std::min<int>(mipmap->width - 2, std::floor(tc.x));
-										int iy = std::min<int>(mipmap->height - 2, std::floor(tc.y));
-
-										tc.x -= ix;
-										tc.y -= iy;
-
-										vector4f samples[4]
-										{
-											to_vector4f(mipmap->at(ix + 0, iy + 0)),
-											to_vector4f(mipmap->at(ix + 1, iy + 0)),
-											to_vector4f(mipmap->at(ix + 0, iy + 1)),
-											to_vector4f(mipmap->at(ix + 1, iy + 1)),
-										};
-
-										color = (1.f - tc.y) * ((1.f - tc.x) * samples[0] + tc.x * samples[1]) + tc.y * ((1.f - tc.x) * samples[2] + tc.x * samples[3]);
-									}
-								}
-
-								if (command.lights)
-								{
-									vector3f lighting = command.lights->ambient_light;
+							if constexpr (!State::color_write)
+								continue;
 
-									auto normal = normalized(l0[dy][dx] * v0.normal + l1[dy][dx] * v1.normal + l2[dy][dx] * v2.normal);
-									auto position = l0[dy][dx] * v0.world_position + l1[dy][dx] * v1.world_position + l2[dy][dx] * v2.world_position;
+							vector4f color;
 
-									for (auto const & light : command.lights->directional_lights)
-									{
-										lighting = lighting + std::max(0.f, dot(light.direction, normal)) * light.intensity;
-									}
+							if constexpr (State::textured)
+								color = sample_albedo<State::mag_filter, State::min_filter>(*texture, texture_scale, texcoord, dx, dy);
+							else
+								color = l0[dy][dx] * v0.color + l1[dy][dx] * v1.color + l2[dy][dx] * v2.color;
 
-									for (auto const & light : command.lights->point_lights)
-									{
-										vector3f delta = light.position - position;
-										float distance = length(delta);
-										vector3f direction = delta / distance;
-										float attenuation = 1.f / (light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance);
+							if constexpr (State::lit)
+							{
+								auto normal = normalized(l0[dy][dx] * v0.normal + l1[dy][dx] * v1.normal + l2[dy][dx] * v2.normal);
+								auto position = l0[dy][dx] * v0.world_position + l1[dy][dx] * v1.world_position + l2[dy][dx] * v2.world_position;
 
-										lighting = lighting + std::max(0.f, dot(direction, normal)) * attenuation * light.intensity;
-									}
+								color = apply_lighting(*command.lights, color, normal, position);
+							}
 
-									auto result = lighting * to_vector3f(color);
+							auto & pixel = framebuffer.color.at(x + dx, y + dy);
 
-									color = {result.x, result.y, result.z, color.w};
-								}
+							if constexpr (State::blend == blend_mode::alpha)
+								color = color.w * color + (1.f - color.w) * to_vector4f(pixel);
 
-								framebuffer.color.at(x + dx, y + dy) = to_color4ub(color);
-							}
+							pixel = to_color4ub(color);
 						}
 					}
 				}
 			}
 		}
+
+		// Calls f with value as a std::integral_constant, so that f can instantiate a template
+		// with it. Only the listed values are instantiated.
+		template <typename T, T ... Values, typename F>
+		rasterize_function select(T value, F && f)
+		{
+			rasterize_function result = nullptr;
+			((value == Values && (result = f(std::integral_constant<T, Values>{}), true)) || ...);
+			return result;
+		}
+
+		// Picks the rasterization kernel of a draw, once per draw command. States that
+		// cannot be observed are collapsed first, so they share a kernel.
+		rasterize_function select_rasterizer(framebuffer const & framebuffer, draw_command const & command)
+		{
+			depth_test_mode depth_mode = command.depth.mode;
+			bool write_depth = command.depth.write;
+
+			if (!framebuffer.depth)
+			{
+				depth_mode = depth_test_mode::always;
+				write_depth = false;
+			}
+
+			return select<depth_test_mode,
+				depth_test_mode::always,
+				depth_test_mode::less,
+				depth_test_mode::less_equal,
+				depth_test_mode::greater,
+				depth_test_mode::greater_equal,
+				depth_test_mode::equal,
+				depth_test_mode::not_equal>(depth_mode, [&](auto depth_test)
+			{
+				return select<bool, false, true>(write_depth, [&](auto depth_write) -> rasterize_function
+				{
+					if (!framebuffer.color)
+						return &rasterize_triangle<pipeline_state<depth_test, depth_write, false, blend_mode::none, false, filtering::nearest, filtering::nearest, false>>;
+
+					return select<blend_mode, blend_mode::none, blend_mode::alpha>(command.blend_mode, [&](auto blend)
+					{
+						return select<bool, false, true>(command.lights.has_value(), [&](auto lit) -> rasterize_function
+						{
+							if (!command.albedo)
+								return &rasterize_triangle<pipeline_state<depth_test, depth_write, true, blend, false, filtering::nearest, filtering::nearest, lit>>;
+
+							return select<filtering, filtering::nearest, filtering::linear>(command.albedo->sampler.mag_filter, [&](auto mag_filter)
+							{
+								return select<filtering, filtering::nearest, filtering::linear>(command.albedo->sampler.min_filter, [&](auto min_filter) -> rasterize_function
+								{
+									return &rasterize_triangle<pipeline_state<depth_test, depth_write, true, blend, true, mag_filter, min_filter, lit>>;
+								});
+							});
+						});
+					});
+				});
+			});
+		}
+
+		template <cull_mode Cull>
+		void draw_triangles(framebuffer const & framebuffer, viewport const & viewport, draw_command const & command, rasterize_function rasterize)
+		{
+			auto view_projection = command.projection * command.view;
+
+			for (std::uint32_t vertex_index = 0; vertex_index + 2 < command.mesh.count; vertex_index += 3)
+			{
+				std::uint32_t indices[3]
+				{
+					vertex_index + 0,
+					vertex_index + 1,
+					vertex_index + 2,
+				};
+
+				if (command.mesh.indices)
+					for (int i = 0; i < 3; ++i)
+						indices[i] = command.mesh.indices[indices[i]];
+
+				vertex clipped_vertices[12];
+
+				for (int i = 0; i < 3; ++i)
+				{
+					clipped_vertices[i].world_position = to_vector3f(command.model * as_point(command.mesh.positions[indices[i]]));
+					clipped_vertices[i].position = view_projection * as_point(clipped_vertices[i].world_position);
+					clipped_vertices[i].normal = to_vector3f(command.model * as_vector(command.mesh.normals[indices[i]]));
+					clipped_vertices[i].color = command.mesh.colors[indices[i]];
+					clipped_vertices[i].texcoord = command.mesh.texcoords[indices[i]];
+				}
+
+				auto clipped_vertices_end = clip_triangle(clipped_vertices, clipped_vertices + 3);
+
+				for (auto triangle_begin = clipped_vertices; triangle_begin != clipped_vertices_end; triangle_begin += 3)
+				{
+					auto v0 = triangle_begin[0];
+					auto v1 = triangle_begin[1];
+					auto v2 = triangle_begin[2];
+
+					v0.position = perspective_divide(v0.position);
+					v1.position = perspective_divide(v1.position);
+					v2.position = perspective_divide(v2.position);
+
+					v0.position = apply(viewport, v0.position);
+					v1.position = apply(viewport, v1.position);
+					v2.position = apply(viewport, v2.position);
+
+					bool const ccw = det2D(v1.position - v0.position, v2.position - v0.position) < 0.f;
+
+					if constexpr (Cull == cull_mode::none)
+					{
+						if (ccw)
+							std::swap(v1, v2);
+					}
+					else if constexpr (Cull == cull_mode::cw)
+					{
+						if (!ccw)
+							continue;
+						std::swap(v1, v2);
+					}
+					else if constexpr (Cull == cull_mode::ccw)
+					{
+						if (ccw)
+							continue;
+					}
+
+					rasterize(framebuffer, viewport, command, v0, v1, v2);
+				}
+			}
+		}
+
+	}
+
+	void clear(image_view<color4ub> const & color_buffer, vector4f const & color)
+	{
+		auto ptr = color_buffer.pixels;
+		auto size = color_buffer.width * color_buffer.height;
+		std::fill(ptr, ptr + size, to_color4ub(color));
+	}
+
+	void clear(image_view<std::uint32_t> const & depth_buffer, std::uint32_t value)
+	{
+		auto ptr = depth_buffer.pixels;
+		auto size = depth_buffer.width * depth_buffer.height;
+		std::fill(ptr, ptr + size, value);
+	}
+
+	void draw(framebuffer const & framebuffer, viewport const & viewport, draw_command const & command)
+	{
+		// Nothing to write to
+		if (!framebuffer.color && !framebuffer.depth)
+			return;
+
+		// Every pixel fails the depth test
+		if (framebuffer.depth && command.depth.mode == depth_test_mode::never)
+			return;
+
+		auto rasterize = select_rasterizer(framebuffer, command);
+
+		switch (command.cull_mode)
+		{
+		case cull_mode::none:
+			draw_triangles<cull_mode::none>(framebuffer, viewport, command, rasterize);
+			break;
+		case cull_mode::cw:
+			draw_triangles<cull_mode::cw>(framebuffer, viewport, command, rasterize);
+			break;
+		case cull_mode::ccw:
+			draw_triangles<cull_mode::ccw>(framebuffer, viewport, command, rasterize);
+			break;
+		}
 	}
 
 }
@@ -22,6 +22,13 @@ namespace rasterizer
 		not_equal,
 	};
 
+	enum class blend_mode
+	{
+		none,
+		// source * source.a + destination * (1 - source.a)
+		alpha,
+	};
+
 	struct depth_settings
 	{
 		bool write = true;